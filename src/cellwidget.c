@@ -26,15 +26,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "keys.h"
 #include <string.h>
 
-/* stroke.c */
-void smooth_stroke(Stroke *s);
-void simplify_stroke(Stroke *s);
-
 /* cellwidget.c */
 int cell_widget_scrollbar_width(void);
+static gunichar completion_char(int cell);
+static void clear_completions(void);
 static void start_timeout(void);
 static void show_context_menu(int button, int time);
 static void stop_drawing(void);
+static void draw(double x, double y);
 
 /*
         Cells
@@ -55,8 +54,10 @@ static void stop_drawing(void);
 #define CELL_VERIFIED   0x04
 #define CELL_SHIFTED    0x08
 
+/* Cells only point to their ink so that moving cells around the grid copies
+   as little as possible */
 struct Cell {
-        Sample sample, *alts[ALTERNATES];
+        Sample *sample, *alts[ALTERNATES];
         gunichar ch;
         int alt_used[ALTERNATES];
         char flags, alt_ratings[ALTERNATES];
@@ -92,7 +93,8 @@ static int cell_cols, cell_rows, cell_row_view = 0, current_cell = -1, old_cc,
            timeout_source,
            drawing = FALSE, inserting = FALSE, eraser = FALSE, invalid = FALSE,
            potential_insert = FALSE, potential_hold = FALSE, cross_out = FALSE,
-           show_keys = TRUE, is_clear = TRUE, keys_dirty = FALSE;
+           show_keys = TRUE, is_clear = TRUE, keys_dirty = FALSE,
+           frame_dirty = TRUE;
 static double cursor_x, cursor_y;
 
 static void cell_coords(int cell, int *px, int *py)
@@ -112,12 +114,53 @@ static void set_pen_color(Sample *sample, int cell)
 /* Selects the pen color depending on if the sample being drawn is the input
    or the template sample */
 {
-        if (sample == input || sample == &cells[cell].sample)
+        if (sample == input || sample == cells[cell].sample)
                 cairo_set_source_gdk_color(cairo, &color_ink, 1.);
         else
                 cairo_set_source_gdk_color(cairo, &color_select, 1.);
 }
 
+/* Msec between drawing new ink while the pen is moving, about a frame */
+#define INK_INTERVAL 16
+
+static GdkRectangle damage;
+static int damage_pending = FALSE, ink_source = 0, ink_drawn;
+
+static void damage_add(int x, int y, int width, int height)
+/* Add an area to the area that needs to be redrawn */
+{
+        GdkRectangle rect;
+
+        rect.x = x;
+        rect.y = y;
+        rect.width = width;
+        rect.height = height;
+        if (damage_pending)
+                gdk_rectangle_union(&damage, &rect, &damage);
+        else {
+                damage = rect;
+                damage_pending = TRUE;
+        }
+}
+
+static void damage_flush(void)
+/* Queue a single redraw for all of the damaged area */
+{
+        if (!damage_pending)
+                return;
+        gtk_widget_queue_draw_area(drawing_area, damage.x, damage.y,
+                                   damage.width, damage.height);
+        damage_pending = FALSE;
+}
+
+static double pen_width(void)
+{
+        double width;
+
+        width = cell_height / 33.;
+        return width > 1. ? width : 1.;
+}
+
 static void render_point(Sample *sample, int cell, int stroke, Vec2 *offset)
 /* Draw a single point stroke */
 {
@@ -143,96 +186,91 @@ static void render_point(Sample *sample, int cell, int stroke, Vec2 *offset)
 
         /* Draw a dot with cairo */
         cairo_new_path(cairo);
-        radius = cell_height / 33.;
-        cairo_arc(cairo, x, y, radius > 1. ? radius : 1., 0., 2 * M_PI);
+        radius = pen_width();
+        cairo_arc(cairo, x, y, radius, 0., 2 * M_PI);
         set_pen_color(sample, cell);
         cairo_fill(cairo);
 
-        gtk_widget_queue_draw_area(drawing_area, x - radius - 0.5,
-                                   y - radius - 0.5, radius * 2 + 0.5,
-                                   radius * 2 + 0.5);
+        damage_add(x - radius - 0.5, y - radius - 0.5, radius * 2 + 2.,
+                   radius * 2 + 2.);
 }
 
-static void render_segment(Sample *sample, int cell, int stroke, int seg,
-                           Vec2 *offset)
-/* Draw a segment of the stroke
-   FIXME since the segments are not properly connected according to Cairo,
-         there is a bit of missing value at the segment connection points */
+static void render_stroke(Sample *sample, int cell, int stroke, int start,
+                          Vec2 *offset)
+/* Draw a stroke from a point onwards as a single path. Joints are rounded
+   so there are no gaps between the segments or between separately drawn
+   parts of the same stroke. */
 {
-        double pen_width, x1, x2, y1, y2;
-        int xmin, xmax, ymin, ymax, cx, cy, pen_range;
+        Stroke *s;
+        double width, x, y, xmin = 0., xmax = 0., ymin = 0., ymax = 0.;
+        int i, cx, cy, pen_range;
 
-        if (!cairo || stroke < 0 || !sample || stroke >= sample->len ||
-            seg < 0 || seg >= sample->strokes[stroke]->len - 1)
+        if (!cairo || stroke < 0 || !sample || stroke >= sample->len)
+                return;
+        s = sample->strokes[stroke];
+        if (start < 0)
+                start = 0;
+        if (start >= s->len - 1)
                 return;
 
-        x1 = sample->strokes[stroke]->points[seg].x;
-        x2 = sample->strokes[stroke]->points[seg + 1].x;
-        y1 = sample->strokes[stroke]->points[seg].y;
-        y2 = sample->strokes[stroke]->points[seg + 1].y;
-
-        /* Apply offset */
-        if (offset) {
-                x1 += offset->x;
-                y1 += offset->y;
-                x2 += offset->x;
-                y2 += offset->y;
-        }
-
-        /* Unscale coordinates */
+        /* Unscale the coordinates and build the path */
         cell_coords(cell, &cx, &cy);
-        x1 = cx + cell_width / 2 + x1 * cell_height / SCALE;
-        x2 = cx + cell_width / 2 + x2 * cell_height / SCALE;
-        y1 = cy + cell_height / 2 + y1 * cell_height / SCALE;
-        y2 = cy + cell_height / 2 + y2 * cell_height / SCALE;
-
-        /* Find minimum and maximum x and y */
-        if (x1 > x2) {
-                xmax = x1 + 0.9999;
-                xmin = x2;
-        } else {
-                xmin = x1;
-                xmax = x2 + 0.9999;
-        }
-        if (y1 > y2) {
-                ymax = y1 + 0.9999;
-                ymin = y2;
-        } else {
-                ymin = y1;
-                ymax = y2 + 0.9999;
+        cairo_new_path(cairo);
+        for (i = start; i < s->len; i++) {
+                x = s->points[i].x;
+                y = s->points[i].y;
+                if (offset) {
+                        x += offset->x;
+                        y += offset->y;
+                }
+                x = cx + cell_width / 2 + x * cell_height / SCALE;
+                y = cy + cell_height / 2 + y * cell_height / SCALE;
+                if (i == start) {
+                        cairo_move_to(cairo, x, y);
+                        xmin = xmax = x;
+                        ymin = ymax = y;
+                        continue;
+                }
+                cairo_line_to(cairo, x, y);
+                if (x < xmin)
+                        xmin = x;
+                else if (x > xmax)
+                        xmax = x;
+                if (y < ymin)
+                        ymin = y;
+                else if (y > ymax)
+                        ymax = y;
         }
 
-        /* Draw the new segment using Cairo */
-        cairo_new_path(cairo);
-        cairo_move_to(cairo, x1, y1);
-        cairo_line_to(cairo, x2, y2);
+        /* Stroke the path using Cairo */
+        width = pen_width();
+        cairo_save(cairo);
         set_pen_color(sample, cell);
-        pen_width = cell_height / 33.;
-        if (pen_width < 1.)
-                pen_width = 1.;
-        cairo_set_line_width(cairo, pen_width);
+        cairo_set_line_width(cairo, width);
+        cairo_set_line_cap(cairo, CAIRO_LINE_CAP_ROUND);
+        cairo_set_line_join(cairo, CAIRO_LINE_JOIN_ROUND);
         cairo_stroke(cairo);
+        cairo_restore(cairo);
 
-        /* Dirty only the new segment */
-        pen_range = 2 * pen_width + 0.9999;
-        gtk_widget_queue_draw_area(drawing_area, xmin - pen_range,
-                                   ymin - pen_range,
-                                   xmax - xmin + pen_range + 1,
-                                   ymax - ymin + pen_range + 1);
+        /* Dirty only the area the path covers */
+        pen_range = 2 * width + 0.9999;
+        damage_add((int)xmin - pen_range, (int)ymin - pen_range,
+                   (int)(xmax + 0.9999) - (int)xmin + 2 * pen_range + 1,
+                   (int)(ymax + 0.9999) - (int)ymin + 2 * pen_range + 1);
 }
 
 static void render_sample(Sample *sample, int cell)
 /* Render the ink from a sample in a cell */
 {
         Vec2 sc_to_ic;
-        int i, j;
+        int i;
 
         if (!sample)
                 return;
 
         /* Center stored samples on input */
-        if (sample != &cells[cell].sample)
-                center_samples(&sc_to_ic, sample, &cells[cell].sample);
+        if (cells[cell].sample && sample != cells[cell].sample)
+                center_samples(&sc_to_ic, sample, cells[cell].sample);
         else
                 vec2_set(&sc_to_ic, 0., 0.);
 
@@ -241,8 +279,170 @@ static void render_sample(Sample *sample, int cell)
                     sample->strokes[i]->spread < DOT_SPREAD)
                         render_point(sample, cell, i, &sc_to_ic);
                 else
-                        for (j = 0; j < sample->strokes[i]->len - 1; j++)
-                                render_segment(sample, cell, i, j, &sc_to_ic);
+                        render_stroke(sample, cell, i, 0, &sc_to_ic);
+        damage_flush();
+}
+
+/* Pen points captured between frames, at least a second of motion for any
+   device that reports less than 500 points a second */
+#define PEN_POINTS 512
+
+typedef struct {
+        double x, y;
+        guint32 time;
+} PenPoint;
+
+static PenPoint pen_points[PEN_POINTS];
+static guint32 pen_time;
+static int pen_head, pen_tail;
+
+static void pen_push(double x, double y, guint32 time)
+/* Queue a point for the next frame. If a whole ring of points is waiting the
+   oldest point is dropped. */
+{
+        if (x < 0 || x > drawing_area->allocation.width ||
+            y < 0 || y > drawing_area->allocation.height)
+                return;
+        pen_points[pen_head].x = x;
+        pen_points[pen_head].y = y;
+        pen_points[pen_head].time = time;
+        pen_head = (pen_head + 1) % PEN_POINTS;
+        if (pen_head == pen_tail)
+                pen_tail = (pen_tail + 1) % PEN_POINTS;
+        pen_time = time;
+}
+
+static void pen_capture(GdkEventMotion *event, double x, double y)
+/* Queue the motion event's point along with any points the device recorded
+   since the last one we saw. Motion hints compress events, so without the
+   device history fast strokes lose points. */
+{
+        GdkTimeCoord **history;
+        int i, len;
+
+        if (pen_time && event->time > pen_time + 1 &&
+            gdk_device_get_history(event->device, event->window, pen_time + 1,
+                                   event->time - 1, &history, &len)) {
+                for (i = 0; i < len; i++) {
+                        double hx, hy;
+
+                        if (gdk_device_get_axis(event->device, history[i]->axes,
+                                                GDK_AXIS_X, &hx) &&
+                            gdk_device_get_axis(event->device, history[i]->axes,
+                                                GDK_AXIS_Y, &hy))
+                                pen_push(hx, hy, history[i]->time);
+                }
+                gdk_device_free_history(history, len);
+        }
+        pen_push(x, y, event->time);
+}
+
+static void pen_reset(guint32 time)
+/* Drop any waiting points and start capturing history from a time */
+{
+        pen_head = pen_tail = 0;
+        pen_time = time;
+}
+
+static gboolean ink_timeout(void)
+/* Add the points captured since the last frame to the stroke and draw them
+   as one path */
+{
+        Stroke *stroke;
+
+        ink_source = 0;
+        for (; pen_tail != pen_head; pen_tail = (pen_tail + 1) % PEN_POINTS)
+                if (drawing)
+                        draw(pen_points[pen_tail].x, pen_points[pen_tail].y);
+        if (!drawing || !input || !input->len || current_cell < 0 ||
+            input != cells[current_cell].sample)
+                return FALSE;
+        stroke = input->strokes[input->len - 1];
+
+        /* A stroke that ran out of room may have been simplified */
+        if (ink_drawn > stroke->len - 2)
+                ink_drawn = stroke->len - 2;
+        render_stroke(input, current_cell, input->len - 1, ink_drawn, NULL);
+        /* The last point can still be replaced by the next one, so the next
+           path starts from the segment before it */
+        if (stroke->len > 2)
+                ink_drawn = stroke->len - 2;
+        damage_flush();
+        return FALSE;
+}
+
+static void queue_ink(void)
+/* New points are drawn on the next frame */
+{
+        if (!ink_source)
+                ink_source = g_timeout_add(INK_INTERVAL,
+                                           (GSourceFunc)ink_timeout, NULL);
+}
+
+static void cancel_ink(void)
+{
+        if (!ink_source)
+                return;
+        g_source_remove(ink_source);
+        ink_source = 0;
+}
+
+/*
+        Glyph cache
+*/
+
+/* Maximum number of cached glyphs, training a large block can show a lot of
+   different characters */
+#define GLYPHS_MAX 1024
+
+typedef struct {
+        PangoLayout *layout;
+        int width;
+} Glyph;
+
+static GHashTable *glyphs = NULL;
+
+static void glyph_free(Glyph *glyph)
+{
+        g_object_unref(glyph->layout);
+        g_free(glyph);
+}
+
+static void clear_glyphs(void)
+/* Glyphs have to be laid out again when the font changes */
+{
+        if (!glyphs)
+                return;
+        g_hash_table_destroy(glyphs);
+        glyphs = NULL;
+}
+
+static Glyph *get_glyph(gunichar ch)
+/* Get the layout for a character. Layouts do not depend on the color they
+   are drawn in so they only need to be shaped and measured once. */
+{
+        PangoRectangle ink_ext, log_ext;
+        Glyph *glyph;
+        char string[7] = { 0, 0, 0, 0, 0, 0, 0 };
+
+        if (glyphs && g_hash_table_size(glyphs) >= GLYPHS_MAX)
+                clear_glyphs();
+        if (!glyphs)
+                glyphs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                               NULL,
+                                               (GDestroyNotify)glyph_free);
+        glyph = g_hash_table_lookup(glyphs, GUINT_TO_POINTER(ch));
+        if (glyph)
+                return glyph;
+        glyph = g_malloc(sizeof (*glyph));
+        glyph->layout = pango_layout_new(pango);
+        g_unichar_to_utf8(ch, string);
+        pango_layout_set_text(glyph->layout, string, -1);
+        pango_layout_set_font_description(glyph->layout, pango_font_desc);
+        pango_layout_get_pixel_extents(glyph->layout, &ink_ext, &log_ext);
+        glyph->width = log_ext.width;
+        g_hash_table_insert(glyphs, GUINT_TO_POINTER(ch), glyph);
+        return glyph;
 }
 
 static int cell_offscreen(int cell)
@@ -278,6 +478,7 @@ static void render_cell(int i)
         cairo_pattern_t *pattern;
         GdkColor color, *base_color;
         Cell *pc;
+        gunichar ch;
         int x, y, active, cols, samples = 0;
 
         if (!cairo || !pixmap || !pixmap_gc || cell_offscreen(i))
@@ -334,7 +535,7 @@ static void render_cell(int i)
             (current_cell == i && input && input->len)) {
                 int j;
 
-                render_sample(&cells[i].sample, i);
+                render_sample(cells[i].sample, i);
                 if (cells[i].ch)
                         for (j = 0; j < ALTERNATES && cells[i].alts[j]; j++)
                                 if (sample_valid(cells[i].alts[j],
@@ -345,11 +546,10 @@ static void render_cell(int i)
                                 }
         }
 
-        /* Draw letter if recognized or training */
-        else if (pc->ch && (current_cell != i || !input || !input->len)) {
-                PangoLayout *layout;
-                PangoRectangle ink_ext, log_ext;
-                char string[6] = { 0, 0, 0, 0, 0, 0 };
+        /* Draw letter if recognized or training, or the completion */
+        else if ((pc->ch && (current_cell != i || !input || !input->len)) ||
+                 completion_char(i)) {
+                Glyph *glyph;
 
                 /* Training color is determined by how well a character is
                    trained */
@@ -363,6 +563,10 @@ static void render_cell(int i)
                                                     &color, 0.2);
                 }
 
+                /* Completions are faded into the cell */
+                else if (!pc->ch)
+                        highlight_gdk_color(&color_inactive, &color, 0.2);
+
                 /* Use ink color unless this is a questionable match */
                 else {
                         color = color_ink;
@@ -373,16 +577,11 @@ static void render_cell(int i)
                 }
 
                 cairo_set_source_gdk_color(cairo, &color, 1.);
-                layout = pango_layout_new(pango);
-                cairo_move_to(cairo, x, y);
-                g_unichar_to_utf8(pc->ch, string);
-                pango_layout_set_text(layout, string, 6);
-                pango_layout_set_font_description(layout, pango_font_desc);
-                pango_layout_get_pixel_extents(layout, &ink_ext, &log_ext);
-                cairo_rel_move_to(cairo,
-                                  cell_width / 2 - log_ext.width / 2, 2);
-                pango_cairo_show_layout(cairo, layout);
-                g_object_unref(layout);
+                ch = pc->ch ? pc->ch : completion_char(i);
+                glyph = get_glyph(ch);
+                cairo_move_to(cairo, x + cell_width / 2 - glyph->width / 2,
+                              y + 2);
+                pango_cairo_show_layout(cairo, glyph->layout);
         }
 
         /* Insertion arrows */
@@ -464,74 +663,97 @@ static void render_cell(int i)
                 keys_dirty = TRUE;
 }
 
-static void render_dirty(void)
-/* Render cells marked dirty */
+static void render_frame(void)
+/* Render the border and fill the space around the cells */
 {
-        int i;
+        int cols, rows, x, width, height, area_width, area_height;
 
-        for (i = cell_row_view * cell_cols; i < cell_rows * cell_cols; i++)
-                if (cells[i].flags & CELL_DIRTY)
-                        render_cell(i);
-        if (show_keys && keys_dirty) {
-                key_widget_render(key_widget);
-                keys_dirty = FALSE;
-        }
-}
-
-void cell_widget_render(void)
-/* Render the cells */
-{
-        int i, cols, rows, width, height;
-
-        if (!cairo || !pixmap || !pixmap_gc)
+        frame_dirty = FALSE;
+        if (!pixmap || !pixmap_gc)
                 return;
+        area_width = drawing_area->allocation.width;
+        area_height = drawing_area->allocation.height;
 
         /* On-screen keyboard eats up some cells on the end */
         cols = cell_cols;
         if (show_keys)
                 cols -= KEY_WIDGET_COLS;
 
-        /* Render cells */
-        for (i = cell_row_view * cols; i < cell_rows * cols; i++)
-                render_cell(i);
-
         /* Draw border */
         rows = cell_rows < cell_rows_pref ? cell_rows : cell_rows_pref;
         width = cell_width * cols + 1;
         height = cell_height * rows + 1;
+        x = right_to_left ? area_width - width - 1 : 0;
         gdk_gc_set_rgb_fg_color(pixmap_gc, &color_bg_dark);
-        if (!right_to_left)
-                gdk_draw_rectangle(pixmap, pixmap_gc, FALSE, 0, 0,
-                                   width, height);
-        else
-                gdk_draw_rectangle(pixmap, pixmap_gc, FALSE,
-                                   drawing_area->allocation.width - width - 1,
-                                   0, width, height);
+        gdk_draw_rectangle(pixmap, pixmap_gc, FALSE, x, 0, width, height);
+        gtk_widget_queue_draw_area(drawing_area, x, 0, width + 1, 1);
+        gtk_widget_queue_draw_area(drawing_area, x, height, width + 1, 1);
+        gtk_widget_queue_draw_area(drawing_area, x, 0, 1, height + 1);
+        gtk_widget_queue_draw_area(drawing_area, x + width, 0, 1, height + 1);
 
         /* Fill extra space to the right */
         gdk_gc_set_rgb_fg_color(pixmap_gc, &color_bg);
-        if (!right_to_left)
-                gdk_draw_rectangle(pixmap, pixmap_gc, TRUE, width + 1, 0,
-                                   drawing_area->allocation.width - width,
-                                   height + 1);
-        else
-                gdk_draw_rectangle(pixmap, pixmap_gc, TRUE, 0, 0,
-                                   drawing_area->allocation.width - width - 1,
+        x = right_to_left ? 0 : width + 1;
+        gdk_draw_rectangle(pixmap, pixmap_gc, TRUE, x, 0,
+                           area_width - width - 1, height + 1);
+        gtk_widget_queue_draw_area(drawing_area, x, 0, area_width - width - 1,
                                    height + 1);
 
         /* Fill extra space below */
         gdk_draw_rectangle(pixmap, pixmap_gc, TRUE, 0, height + 1,
-                           drawing_area->allocation.width,
-                           drawing_area->allocation.height - height + 1);
+                           area_width, area_height - height + 1);
+        gtk_widget_queue_draw_area(drawing_area, 0, height + 1, area_width,
+                                   area_height - height + 1);
+}
+
+static void render_dirty(void)
+/* Render cells marked dirty. Only the rows in view are checked, cells
+   scrolled out of view are rendered when they are scrolled back in. */
+{
+        int i, rows;
 
-        /* Render the on-screen keyboard */
-        if (show_keys) {
+        if (!cairo || !pixmap || !pixmap_gc)
+                return;
+        rows = cell_row_view + cell_rows_pref > cell_rows ?
+               cell_rows : cell_row_view + cell_rows_pref;
+        for (i = cell_row_view * cell_cols; i < rows * cell_cols; i++)
+                if (cells[i].flags & CELL_DIRTY)
+                        render_cell(i);
+        if (frame_dirty) {
+                render_frame();
+                keys_dirty = TRUE;
+        }
+
+        /* The slaved on-screen keyboard does not dirty the drawing area
+           itself */
+        if (show_keys && keys_dirty) {
                 key_widget_render(key_widget);
+                gtk_widget_queue_draw_area(drawing_area, key_widget->x,
+                                           key_widget->y, key_widget->width,
+                                           key_widget->height);
                 keys_dirty = FALSE;
         }
+}
+
+void cell_widget_render(void)
+/* Render all of the cells in view, the border and the on-screen keyboard.
+   Only needed when everything has changed, otherwise dirty the cells that
+   changed and call render_dirty(). */
+{
+        dirty_all();
+        frame_dirty = TRUE;
+        render_dirty();
+}
 
-        /* Dirty the entire drawing area */
-        gtk_widget_queue_draw(drawing_area);
+static void set_show_keys(int on)
+/* Show or hide the on-screen keyboard, the cells under it and the border
+   around the cells change */
+{
+        if (show_keys == on)
+                return;
+        show_keys = on;
+        dirty_all();
+        frame_dirty = TRUE;
 }
 
 static void clear_cell(int i)
@@ -545,11 +767,25 @@ static void clear_cell(int i)
                         input = NULL;
                 cell->flags |= CELL_DIRTY;
         }
-        clear_sample(&cell->sample);
+        if (cell->sample) {
+                if (cell->sample == input)
+                        input = NULL;
+                clear_sample(cell->sample);
+                g_free(cell->sample);
+                cell->sample = NULL;
+        }
         cell->ch = 0;
         cell->alts[0] = NULL;
 }
 
+static Sample *cell_sample(int cell)
+/* Get a cell's sample, allocating it when the cell is first drawn in */
+{
+        if (!cells[cell].sample)
+                cells[cell].sample = g_malloc0(sizeof (Sample));
+        return cells[cell].sample;
+}
+
 static void pad_cell(int cell)
 {
         int i;
@@ -575,12 +811,25 @@ static void free_cells(void)
         input = NULL;
 }
 
+static int cell_changed(const Cell *a, const Cell *b)
+/* Returns TRUE if the two cells would not render the same */
+{
+        return a->ch != b->ch || a->flags != b->flags ||
+               a->sample != b->sample ||
+               a->alts[0] != b->alts[0] || a->alts[1] != b->alts[1] ||
+               a->alt_ratings[0] != b->alt_ratings[0] ||
+               a->alt_ratings[1] != b->alt_ratings[1];
+}
+
 static void wrap_cells(int new_rows, int new_cols)
 /* Word wrap cells */
 {
         Cell *new_cells;
         int i, j, size, row, col, break_i = -1, break_j = -1;
 
+        /* Cells are about to move */
+        clear_completions();
+
         /* Allocate and clear the new grid */
         if (new_rows < 1)
                 new_rows = 1;
@@ -588,8 +837,12 @@ static void wrap_cells(int new_rows, int new_cols)
         new_cells = g_malloc0(size);
 
         for (i = 0, j = 0, row = 0, col = 0; i < cell_rows * cell_cols; i++) {
-                if (!cells[i].ch)
+
+                /* Blank cells are dropped but may still own a sample */
+                if (!cells[i].ch) {
+                        clear_cell(i);
                         continue;
+                }
 
                 /* Break at non-alphanumeric characters */
                 if (!g_unichar_isalnum(cells[i].ch)) {
@@ -616,8 +869,10 @@ static void wrap_cells(int new_rows, int new_cols)
                                 break_i = -1;
                         }
                         col = 0;
-                        if (!cells[i].ch)
+                        if (!cells[i].ch) {
+                                clear_cell(i);
                                 continue;
+                        }
                 }
                 new_cells[j++] = cells[i];
                 col++;
@@ -631,6 +886,12 @@ static void wrap_cells(int new_rows, int new_cols)
                        new_cols * sizeof (Cell));
         }
 
+        /* Only the cells that moved need to be rendered again */
+        for (i = 0; i < new_rows * new_cols; i++)
+                if (new_cols != cell_cols || i >= cell_rows * cell_cols ||
+                    cell_changed(cells + i, new_cells + i))
+                        new_cells[i].flags |= CELL_DIRTY;
+
         /* Only free the cell array, NOT the samples as we have copied the
            Sample data over to the new cell array */
         g_free(cells);
@@ -674,11 +935,15 @@ static int pack_cells(int new_rows, int new_cols)
    Returns TRUE if the widget was resized in the process and can expect a
    configure event in the near future. */
 {
-        int i, rows, range, new_range;
+        int i, rows, range, new_range, old_rows, old_cols, old_view,
+            changed = FALSE;
 
         /* Must have at least one row */
         if (new_rows < 1)
                 new_rows = 1;
+        old_rows = cell_rows < cell_rows_pref ? cell_rows : cell_rows_pref;
+        old_cols = cell_cols;
+        old_view = cell_row_view;
 
         /* Word wrapping will perform its own memory allocation */
         if (!training && cells)
@@ -713,8 +978,8 @@ static int pack_cells(int new_rows, int new_cols)
 
                 cell_rows = new_rows;
                 cell_cols = new_cols;
+                changed = TRUE;
         }
-        dirty_all();
 
         /* Update the scrollbar */
         if (cell_rows <= cell_rows_pref) {
@@ -734,6 +999,14 @@ static int pack_cells(int new_rows, int new_cols)
                 gtk_widget_show(scrollbar);
         }
 
+        /* Everything in view moves if the grid was resized or scrolled */
+        rows = cell_rows < cell_rows_pref ? cell_rows : cell_rows_pref;
+        if (changed || rows != old_rows || cell_cols != old_cols ||
+            cell_row_view != old_view) {
+                dirty_all();
+                frame_dirty = TRUE;
+        }
+
         return set_size_request(FALSE);
 }
 
@@ -745,6 +1018,282 @@ static void stop_timeout(void)
         timeout_source = 0;
 }
 
+/*
+        Word decoding
+*/
+
+#ifndef DISABLE_WORDFREQ
+
+/* Longest word that will be decoded */
+#define DECODE_WORD_MAX 32
+
+/* Number of paths kept for each cell */
+#define DECODE_BEAM 8
+
+/* Rating lost when a path leaves the dictionary */
+#define DECODE_OOV 8
+
+typedef struct {
+        int score, node, prev;
+        gunichar ch;
+} DecodePath;
+
+static int decode_alternates(int cell, gunichar *chars, int *ratings)
+/* Get the characters a cell can be decoded as and their ratings. Cells the
+   user has corrected can only be what they are now. */
+{
+        Cell *pc = cells + cell;
+        int i, j, len = 0;
+
+        if (!(pc->flags & (CELL_VERIFIED | CELL_SHIFTED)))
+                for (i = 0; i < ALTERNATES && pc->alts[i]; i++) {
+                        gunichar ch;
+
+                        if (!sample_valid(pc->alts[i], pc->alt_used[i]))
+                                break;
+                        ch = pc->alts[i]->ch;
+                        if (!g_unichar_isalnum(ch))
+                                continue;
+                        chars[len] = ch;
+                        ratings[len++] = pc->alt_ratings[i];
+                }
+
+        /* If the current character is not an alternate, it was not picked
+           by the recognizer and stays put */
+        for (j = 0; j < len && chars[j] != pc->ch; j++);
+        if (j >= len) {
+                chars[0] = pc->ch;
+                ratings[0] = 0;
+                len = 1;
+        }
+        return len;
+}
+
+static int decode_next(int node, gunichar ch, int *score)
+/* Follow a character down the dictionary, penalizing the path if it leaves
+   the dictionary */
+{
+        if (node < 0)
+                return -1;
+        node = wordfreq_child(node, ch);
+        if (node < 0)
+                *score -= DECODE_OOV;
+        return node;
+}
+
+static int decode_end(int node, int complete)
+/* Score for ending a path. Only finished words are rewarded for being
+   common words, unfinished words only need to be valid prefixes. */
+{
+        int count;
+
+        if (!complete || node < 0)
+                return 0;
+        count = wordfreq_ends(node);
+        return count > 0 ? count : -DECODE_OOV;
+}
+
+static int decode_learned(DecodePath (*paths)[DECODE_BEAM], int len, int path)
+/* Score a finished path as a learned word */
+{
+        gunichar word[DECODE_WORD_MAX];
+        int k;
+
+        for (k = len - 1; k >= 0; k--) {
+                word[k] = paths[k][path].ch;
+                path = paths[k][path].prev;
+        }
+        return wordfreq_learned(word, len);
+}
+
+static void decode_add(DecodePath *paths, int *len, const DecodePath *path)
+/* Add a path to the beam. Paths at the same dictionary node have the same
+   future so only the better one is kept. */
+{
+        int i, worst = 0;
+
+        for (i = 0; i < *len; i++) {
+                if (paths[i].node == path->node) {
+                        if (paths[i].score < path->score)
+                                paths[i] = *path;
+                        return;
+                }
+                if (paths[i].score < paths[worst].score)
+                        worst = i;
+        }
+        if (*len < DECODE_BEAM)
+                paths[(*len)++] = *path;
+        else if (paths[worst].score < path->score)
+                paths[worst] = *path;
+}
+
+static int decode_word(int cell)
+/* Decode the word around a cell with a beam search over the alternates of
+   its cells. Cells are corrected if a different combination of alternates
+   makes a better word. Returns the first cell of the word. */
+{
+        static DecodePath paths[DECODE_WORD_MAX][DECODE_BEAM];
+        gunichar chars[ALTERNATES], word[DECODE_WORD_MAX];
+        int i, j, k, min, max, len, complete, best, best_score, score, node,
+            ratings[ALTERNATES], paths_len[DECODE_WORD_MAX];
+
+        if (!g_unichar_isalnum(cells[cell].ch))
+                return cell;
+
+        /* Find the word, words that are too long are left alone */
+        for (min = cell; min > 0 && g_unichar_isalnum(cells[min - 1].ch);
+             min--);
+        for (max = cell + 1; max < cell_rows * cell_cols &&
+             g_unichar_isalnum(cells[max].ch); max++);
+        len = max - min;
+        if (len < 2 || len > DECODE_WORD_MAX)
+                return min;
+        complete = max < cell_rows * cell_cols && cells[max].ch;
+
+        /* Score the current word */
+        for (k = 0, node = 0, score = 0; k < len; k++) {
+                decode_alternates(min + k, chars, ratings);
+                for (i = 0; chars[i] != cells[min + k].ch; i++);
+                score += ratings[i];
+                node = decode_next(node, chars[i], &score);
+                word[k] = chars[i];
+        }
+        score += decode_end(node, complete);
+        if (complete)
+                score += wordfreq_learned(word, len);
+
+        /* Search the alternates */
+        for (k = 0; k < len; k++) {
+                int n = decode_alternates(min + k, chars, ratings);
+
+                paths_len[k] = 0;
+                for (j = 0; j < (k ? paths_len[k - 1] : 1); j++)
+                        for (i = 0; i < n; i++) {
+                                DecodePath path;
+
+                                path.score = ratings[i];
+                                path.node = 0;
+                                if (k) {
+                                        path.score += paths[k - 1][j].score;
+                                        path.node = paths[k - 1][j].node;
+                                }
+                                path.node = decode_next(path.node, chars[i],
+                                                        &path.score);
+                                path.prev = j;
+                                path.ch = chars[i];
+                                decode_add(paths[k], paths_len + k, &path);
+                        }
+        }
+        for (i = 0, best = -1, best_score = score; i < paths_len[len - 1];
+             i++) {
+                int end = paths[len - 1][i].score +
+                          decode_end(paths[len - 1][i].node, complete);
+
+                if (complete)
+                        end += decode_learned(paths, len, i);
+
+                if (end > best_score) {
+                        best = i;
+                        best_score = end;
+                }
+        }
+        if (best < 0)
+                return min;
+
+        /* Correct the cells along the best path. The sample character is
+           changed too so that this is not counted as a user correction. */
+        for (k = len - 1; k >= 0; k--) {
+                Cell *pc = cells + min + k;
+
+                if (pc->ch != paths[k][best].ch) {
+                        pc->ch = paths[k][best].ch;
+                        if (pc->sample)
+                                pc->sample->ch = pc->ch;
+                        pc->flags |= CELL_DIRTY;
+                }
+                best = paths[k][best].prev;
+        }
+        return min;
+}
+
+static void decode_words(int cell)
+/* Decode the word around a newly recognized cell and the word before it
+   which may have just been finished */
+{
+        int min;
+
+        if (!wordfreq_enable)
+                return;
+        min = decode_word(cell);
+        if (min > 0 && !g_unichar_isalnum(cells[min - 1].ch))
+                min--;
+        if (min > 0)
+                decode_word(min - 1);
+}
+
+#endif /* DISABLE_WORDFREQ */
+
+/*
+        Word completion
+*/
+
+/* Number of completions offered */
+#define COMPLETIONS 5
+
+static gunichar completions[COMPLETIONS][COMPLETION_LEN];
+static int completions_len = 0, completion_cell;
+
+static gunichar completion_char(int cell)
+/* Returns the character of the best completion shown in a cell or zero if
+   the cell does not show one */
+{
+        int i;
+
+        if (!completions_len || training || cell < completion_cell ||
+            cell - completion_cell >= COMPLETION_LEN - 1)
+                return 0;
+        for (i = completion_cell; i <= cell; i++)
+                if (cells[i].ch || !completions[0][i - completion_cell])
+                        return 0;
+        return completions[0][cell - completion_cell];
+}
+
+static void clear_completions(void)
+{
+        int i;
+
+        if (!completions_len)
+                return;
+        for (i = completion_cell; i < cell_rows * cell_cols &&
+             completion_char(i); i++)
+                cells[i].flags |= CELL_DIRTY;
+        completions_len = 0;
+}
+
+#ifndef DISABLE_WORDFREQ
+static void update_completions(int cell)
+/* Complete the word ending at a cell if there is room after it */
+{
+        gunichar pre[COMPLETION_LEN];
+        int i, min, len;
+
+        clear_completions();
+        if (!g_unichar_isalnum(cells[cell].ch) ||
+            cell + 1 >= cell_rows * cell_cols || cells[cell + 1].ch)
+                return;
+        for (min = cell; min > 0 && cell - min < COMPLETION_LEN - 2 &&
+             g_unichar_isalnum(cells[min - 1].ch); min--);
+        for (i = min, len = 0; i <= cell; i++)
+                pre[len++] = cells[i].ch;
+        completion_cell = cell + 1;
+        completions_len = wordfreq_complete(pre, len, completions,
+                                            COMPLETIONS);
+        for (i = completion_cell; i < cell_rows * cell_cols &&
+             completion_char(i); i++)
+                cells[i].flags |= CELL_DIRTY;
+}
+#endif
+
 static void finish_cell(int cell)
 {
         stop_timeout();
@@ -755,7 +1304,7 @@ static void finish_cell(int cell)
 
         /* Train on the input */
         if (training)
-                train_sample(&cells[cell].sample, TRUE);
+                train_sample(cell_sample(cell), TRUE);
 
         /* Recognize input */
         else if (input && input->strokes[0] && input->strokes[0]->len) {
@@ -781,6 +1330,13 @@ static void finish_cell(int cell)
                         pc->alt_used[i] = pc->alts[i]->used;
                 }
 
+#ifndef DISABLE_WORDFREQ
+                /* Recognizing a character may change the best reading of
+                   the rest of the word */
+                decode_words(cell);
+                update_completions(cell);
+#endif
+
                 /* Add a row if this is the last cell */
                 if (cell == cell_rows * cell_cols - 1)
                         pack_cells(0, cell_cols);
@@ -804,7 +1360,7 @@ static gboolean row_timeout(void)
 /* Motion timeout for adding a row */
 {
         pack_cells(cell_rows + 1, cell_cols);
-        cell_widget_render();
+        render_dirty();
         timeout_source = 0;
         return FALSE;
 }
@@ -831,11 +1387,11 @@ static gboolean is_clear_timeout(void)
                 return FALSE;
 
         /* Show the on-screen keyboard */
-        show_keys = keyboard_enabled;
+        set_show_keys(keyboard_enabled);
         is_clear = TRUE;
 
         pack_cells(1, cell_cols);
-        cell_widget_render();
+        render_dirty();
         return FALSE;
 }
 
@@ -933,12 +1489,20 @@ static void stop_drawing(void)
                 }
                 return;
         }
+
+        /* Draw any ink still waiting for the next frame */
+        if (ink_source) {
+                cancel_ink();
+                ink_timeout();
+        }
+        pen_reset(0);
         drawing = FALSE;
         if (!input || input->len >= STROKES_MAX)
                 return;
+
+        /* Strokes are simplified and keep their parameters up to date as
+           they are streamed in, so this normally returns right away */
         stroke = input->strokes[input->len - 1];
-        smooth_stroke(stroke);
-        simplify_stroke(stroke);
         process_stroke(stroke);
         render_cell(current_cell);
         render_sample(input, current_cell);
@@ -947,6 +1511,7 @@ static void stop_drawing(void)
 
 static void erase_cell(int cell)
 {
+        clear_completions();
         if (!training) {
                 clear_cell(cell);
                 render_dirty();
@@ -1056,15 +1621,14 @@ static void check_cell(double x, double y, GdkDevice *device)
 }
 
 static void unclear(int render)
-/* Hides the on-screen keyboard and re-renders the cells.
-   FIXME we only need to render dirty cells */
+/* Hides the on-screen keyboard and renders the cells it uncovered */
 {
         is_clear = FALSE;
         if (!show_keys)
                 return;
-        show_keys = FALSE;
+        set_show_keys(FALSE);
         if (render)
-                cell_widget_render();
+                render_dirty();
 }
 
 static void draw(double x, double y)
@@ -1079,10 +1643,10 @@ static void draw(double x, double y)
 
         /* New character */
         if (!input || !input->len) {
-                clear_sample(&cells[current_cell].sample);
+                input = cell_sample(current_cell);
+                clear_sample(input);
                 cells[current_cell].alts[0] = NULL;
-                input = &cells[current_cell].sample;
-                cells[current_cell].sample.ch = cells[current_cell].ch;
+                input->ch = cells[current_cell].ch;
         }
 
         /* Allocate a new stroke if we aren't already drawing */
@@ -1091,6 +1655,7 @@ static void draw(double x, double y)
                         return;
                 input->strokes[input->len++]= stroke_new(0);
                 drawing = TRUE;
+                ink_drawn = 0;
                 if (input->len == 1)
                         render_cell(current_cell);
         }
@@ -1102,13 +1667,15 @@ static void draw(double x, double y)
         x = (x - cx - cell_width / 2) * SCALE / cell_height;
         y = (y - cy - cell_height / 2) * SCALE / cell_height;
 
-        draw_stroke(&input->strokes[input->len - 1], x, y);
+        stream_stroke(&input->strokes[input->len - 1], x, y);
 }
 
 static void insert_cell(int cell)
 {
         int i;
 
+        clear_completions();
+
         /* Find a blank to consume */
         for (i = cell; i < cell_rows * cell_cols; i++)
                 if (!cells[i].ch)
@@ -1122,25 +1689,32 @@ static void insert_cell(int cell)
                        cell_cols * sizeof (Cell));
                 if (cell_rows > cell_rows_pref)
                         cell_row_view++;
+                dirty_all();
+                frame_dirty = TRUE;
         }
 
+        /* The blank may still own a sample */
+        clear_cell(i);
         if (i > cell)
                 memmove(cells + cell + 1, cells + cell,
                         (i - cell) * sizeof (Cell));
+        for (; i >= cell; i--)
+                dirty_cell(i);
         cells[cell].ch = ' ';
         cells[cell].alts[0] = NULL;
-        cells[cell].sample.len = 0;
-        cells[cell].sample.ch = 0;
+        cells[cell].sample = NULL;
         pad_cell(cell);
         pack_cells(0, cell_cols);
         unclear(FALSE);
-        cell_widget_render();
+        render_dirty();
 }
 
 static void delete_cell(int cell)
 {
         int i, rows;
 
+        clear_completions();
+
         clear_cell(cell);
         memmove(cells + cell, cells + cell + 1,
                 (cell_rows * cell_cols - cell - 1) * sizeof (Cell));
@@ -1154,13 +1728,16 @@ static void delete_cell(int cell)
                 rows--;
         cells[cell_rows * cell_cols - 1].ch = 0;
         cells[cell_rows * cell_cols - 1].alts[0] = NULL;
+        cells[cell_rows * cell_cols - 1].sample = NULL;
+        for (i = cell; i < cell_rows * cell_cols; i++)
+                dirty_cell(i);
 
         pack_cells(0, cell_cols);
-        cell_widget_render();
+        render_dirty();
 }
 
-static void send_cell_key(int cell)
-/* Send the key event for the cell */
+static void commit_cell(int cell)
+/* Collect statistics and train on a cell that is about to be sent */
 {
         int i;
 
@@ -1169,12 +1746,14 @@ static void send_cell_key(int cell)
 
         /* Collect stats and train on corrections */
         if (cells[cell].ch != ' ') {
-                if (cells[cell].ch != cells[cell].sample.ch)
+                Sample *sample = cells[cell].sample;
+
+                if (!sample || cells[cell].ch != sample->ch)
                         corrections++;
                 if (train_on_input && !(cells[cell].flags & CELL_SHIFTED) &&
-                    cells[cell].sample.len) {
-                        cells[cell].sample.ch = cells[cell].ch;
-                        train_sample(&cells[cell].sample, FALSE);
+                    sample && sample->len) {
+                        sample->ch = cells[cell].ch;
+                        train_sample(sample, FALSE);
                 }
                 characters++;
         }
@@ -1189,8 +1768,6 @@ static void send_cell_key(int cell)
                 }
                 demote_sample(cells[cell].alts[i]);
         }
-
-        key_event_send_char(cells[cell].ch);
 }
 
 /*
@@ -1264,6 +1841,62 @@ static gboolean scroll_event(GtkWidget *widget, GdkEventScroll *event)
         return FALSE;
 }
 
+#ifndef DISABLE_WORDFREQ
+static void completions_menu_activate(GtkWidget *widget, gunichar *word)
+/* Fill in the rest of the word and insert the text */
+{
+        int i, len;
+
+        for (len = 0; word[len]; len++);
+        while (completion_cell + len > cell_rows * cell_cols) {
+                cells = g_realloc(cells,
+                                  ++cell_rows * cell_cols * sizeof (Cell));
+                memset(cells + (cell_rows - 1) * cell_cols, 0,
+                       cell_cols * sizeof (Cell));
+        }
+        for (i = 0; i < len; i++) {
+                Cell *pc = cells + completion_cell + i;
+
+                pc->ch = word[i];
+                pc->alts[0] = NULL;
+                pc->flags = CELL_VERIFIED | CELL_DIRTY;
+        }
+        completions_len = 0;
+        window_insert();
+}
+
+static void show_completions_menu(int button, int time)
+/* Popup a menu of the completions for the word before the cursor */
+{
+        GtkWidget *menu, *widget;
+        int i, min;
+
+        menu = gtk_menu_new();
+        for (min = completion_cell - 1; min > 0 &&
+             g_unichar_isalnum(cells[min - 1].ch); min--);
+        for (i = 0; i < completions_len; i++) {
+                GString *string;
+                int j;
+
+                string = g_string_sized_new(COMPLETION_LEN * 2);
+                for (j = min; j < completion_cell; j++)
+                        g_string_append_unichar(string, cells[j].ch);
+                for (j = 0; completions[i][j]; j++)
+                        g_string_append_unichar(string, completions[i][j]);
+                widget = gtk_menu_item_new_with_label(string->str);
+                g_string_free(string, TRUE);
+                g_signal_connect(G_OBJECT(widget), "activate",
+                                 G_CALLBACK(completions_menu_activate),
+                                 completions[i]);
+                gtk_menu_attach(GTK_MENU(menu), widget, 0, 1, i, i + 1);
+        }
+        g_signal_connect(G_OBJECT(menu), "selection-done",
+                         G_CALLBACK(alt_menu_selection_done), NULL);
+        gtk_widget_show_all(menu);
+        gtk_menu_popup(GTK_MENU(menu), 0, 0, 0, 0, button, time);
+}
+#endif
+
 static void context_menu_position(GtkMenu *menu, gint *x, gint *y,
                                   gboolean *push_in)
 /* Positions the two-column context menu so that the column divide is at
@@ -1290,6 +1923,14 @@ static void show_context_menu(int button, int time)
                 return;
         }
 
+#ifndef DISABLE_WORDFREQ
+        /* Blanks showing a completion have a completions menu */
+        if (completion_char(current_cell)) {
+                show_completions_menu(button, time);
+                return;
+        }
+#endif
+
         /* Can't delete blanks */
         if (!cells[current_cell].ch)
                 return;
@@ -1305,7 +1946,7 @@ static void show_context_menu(int button, int time)
         gtk_menu_attach(GTK_MENU(menu), widget, 0, 1, 0, 1);
 
         /* Menu -> Show Ink */
-        if (cells[menu_cell].sample.ch) {
+        if (cells[menu_cell].sample && cells[menu_cell].sample->ch) {
                 const char *label;
 
                 label = cells[menu_cell].flags & CELL_SHOW_INK ?
@@ -1391,10 +2032,12 @@ static gboolean button_press_event(GtkWidget *widget, GdkEventButton *event)
         if (event->button == 1) {
                 if (inserting)
                         potential_insert = TRUE;
-                else if (cells[current_cell].ch) {
+                else if (cells[current_cell].ch ||
+                         completion_char(current_cell)) {
                         start_hold();
                 } else
                         draw(event->x, event->y);
+                pen_reset(event->time);
 
                 /* We are now counting on getting valid coordinates here so
                    save in case we are doing a potential insert/hold and we
@@ -1508,11 +2151,11 @@ static gboolean motion_notify_event(GtkWidget *widget, GdkEventMotion *event)
         cursor_x = x;
         cursor_y = y;
 
-        /* Record and draw new segment */
+        /* Capture the new points, they are added to the stroke and drawn
+           with any others that come in before the next frame */
         if (drawing) {
-                draw(cursor_x, cursor_y);
-                render_segment(input, current_cell, input->len - 1,
-                               input->strokes[input->len - 1]->len - 2, NULL);
+                pen_capture(event, cursor_x, cursor_y);
+                queue_ink();
         }
 
         /* Erasing with the eraser. We get MOD5 rather than a button for the
@@ -1590,6 +2233,7 @@ static gboolean configure_event(void)
         pango_font_description_set_absolute_size(pango_font_desc, PANGO_SCALE *
                                                  (cell_height -
                                                   CELL_BASELINE - 2));
+        clear_glyphs();
 
         /* Get the background color */
         color_bg = window->style->bg[0];
@@ -1621,14 +2265,23 @@ static gboolean configure_event(void)
 }
 
 static gboolean expose_event(GtkWidget *widget, GdkEventExpose *event)
-/* Redraw the drawing area from the backing pixmap */
+/* Redraw the exposed rectangles of the drawing area from the backing pixmap.
+   The bounding box of the exposed region can be much larger than the few
+   cells that were actually rendered. */
 {
+        GdkRectangle *rects;
+        GdkGC *gc;
+        int i, len;
+
         if (!pixmap)
                 return FALSE;
-        gdk_draw_drawable(widget->window,
-                          widget->style->fg_gc[GTK_WIDGET_STATE(widget)],
-                          pixmap, event->area.x, event->area.y, event->area.x,
-                          event->area.y, event->area.width, event->area.height);
+        gc = widget->style->fg_gc[GTK_WIDGET_STATE(widget)];
+        gdk_region_get_rectangles(event->region, &rects, &len);
+        for (i = 0; i < len; i++)
+                gdk_draw_drawable(widget->window, gc, pixmap,
+                                  rects[i].x, rects[i].y, rects[i].x,
+                                  rects[i].y, rects[i].width, rects[i].height);
+        g_free(rects);
         return FALSE;
 }
 
@@ -1638,6 +2291,37 @@ static gboolean enter_notify_event(GtkWidget *widget, GdkEventCrossing *event)
         return FALSE;
 }
 
+static void scroll_view(int view)
+/* Scroll the cells by copying the rows that stay in view and rendering only
+   the rows that scrolled into view */
+{
+        int i, rows, delta, keep, width, src_y, dst_y, first;
+
+        delta = view - cell_row_view;
+        rows = cell_rows < cell_rows_pref ? cell_rows : cell_rows_pref;
+        keep = rows - ABS(delta);
+        cell_row_view = view;
+        if (!pixmap || !pixmap_gc || show_keys || frame_dirty || keep <= 0) {
+                cell_widget_render();
+                return;
+        }
+
+        /* Move the rows that are still in view */
+        width = cell_cols * cell_width;
+        src_y = (delta > 0 ? delta : 0) * cell_height + 1;
+        dst_y = (delta > 0 ? 0 : -delta) * cell_height + 1;
+        gdk_draw_drawable(pixmap, pixmap_gc, pixmap, 1, src_y, 1, dst_y,
+                          width, keep * cell_height);
+        gtk_widget_queue_draw_area(drawing_area, 1, 1, width,
+                                   rows * cell_height);
+
+        /* Render the rows that scrolled in */
+        first = delta > 0 ? view + keep : view;
+        for (i = first * cell_cols; i < (first + ABS(delta)) * cell_cols; i++)
+                dirty_cell(i);
+        render_dirty();
+}
+
 static void scrollbar_value_changed(void)
 /* The cell widget has been scrolled */
 {
@@ -1646,8 +2330,7 @@ static void scrollbar_value_changed(void)
         value = gtk_range_get_value(GTK_RANGE(scrollbar));
         if ((int)value == cell_row_view)
                 return;
-        cell_row_view = value;
-        cell_widget_render();
+        scroll_view(value);
 }
 
 /*
@@ -1691,33 +2374,39 @@ int cell_widget_update_colors(void)
                 color_ink = window->style->text[0];
                 color_inactive = window->style->bg[1];
         }
+
+        /* Colors change with the style, which may also change the font */
+        clear_glyphs();
         return !gdk_colors_equal(&old_active, &color_active) ||
                !gdk_colors_equal(&old_inactive, &color_inactive) ||
                !gdk_colors_equal(&old_ink, &color_ink) ||
                !gdk_colors_equal(&old_select, &color_select);
 }
 
-const char *cell_widget_word(void)
-/* Return the current word and the current cell's position in that word
-   FIXME this function ignores wide chars */
+const gunichar *cell_widget_word(void)
+/* Return the current word and the current cell's position in that word. The
+   part of the word before the current cell and the part after it are
+   returned as two zero-terminated strings, one after the other. */
 {
-        static char buf[64];
+        static gunichar buf[64];
         int i, min, max;
 
         memset(buf, 0, sizeof (buf));
         if (cell_offscreen(old_cc))
                 return buf;
 
-        /* Find the start of the word */
-        for (min = old_cc - 1; min >= 0 && cells[min].ch &&
-             g_ascii_isalnum(cells[min].ch) && cells[min].ch < 0x7f; min--);
+        /* Find the start of the word, the prefix must leave room for the
+           rest of the word in the buffer */
+        for (min = old_cc - 1; min >= 0 && old_cc - min < 32 &&
+             cells[min].ch && g_unichar_isalnum(cells[min].ch); min--);
 
         /* Find the end of the word */
         for (max = old_cc + 1; max < cell_rows * cell_cols && cells[max].ch &&
-             g_ascii_isalnum(cells[max].ch) && cells[max].ch < 0x7f; max++);
+             g_unichar_isalnum(cells[max].ch); max++);
 
         /* Copy the word to a buffer */
-        for (++min, i = 0; i < max - min && i < (int)sizeof (buf) - 1; i++)
+        for (++min, i = 0; i < max - min &&
+             i < (int)(sizeof (buf) / sizeof (*buf)) - 1; i++)
                 buf[i] = cells[min + i].ch;
         buf[old_cc - min] = 0;
         buf[i] = 0;
@@ -1727,6 +2416,7 @@ const char *cell_widget_word(void)
 
 void cell_widget_clear(void)
 {
+        clear_completions();
         stop_timeout();
         free_cells();
 
@@ -1741,7 +2431,7 @@ void cell_widget_clear(void)
 
                 /* Show the on-screen keyboard */
                 if (check_clear()) {
-                        show_keys = keyboard_enabled;
+                        set_show_keys(keyboard_enabled);
                         is_clear = TRUE;
                 }
         }
@@ -1751,7 +2441,7 @@ void cell_widget_clear(void)
                 pack_cells(1, cell_cols);
 
                 /* Show the on-screen keyboard */
-                show_keys = keyboard_enabled;
+                set_show_keys(keyboard_enabled);
                 is_clear = TRUE;
         }
 
@@ -1828,7 +2518,7 @@ void cell_widget_pack(void)
         if (!pack_cells(0, cols))
                 set_size_request(TRUE);
         if (is_clear)
-                show_keys = keyboard_enabled;
+                set_show_keys(keyboard_enabled);
 
         /* Right-to-left mode may have changed so we need to reconfigure the
            on-screen keyboard */
@@ -1841,23 +2531,24 @@ void cell_widget_pack(void)
 
 int cell_widget_insert(void)
 {
-        gunichar *utf16;
+        static int inserting;
+        gunichar *utf16, *keys;
         int i, j, slot, chars;
 
-        if (training)
+        /* Sending can run the main loop, so we may get here again or the
+           user may write into the cells before it returns */
+        if (training || inserting)
                 return FALSE;
         chars = 0;
-
-        /* Prepare for sending key events */
-        key_event_update_mappings();
+        keys = g_malloc(sizeof (*keys) * cell_rows * cell_cols);
 
         /* Need to send the keys out in reverse order for right_to_left mode
            because the cells are displayed with columns reversed */
         if (right_to_left)
                 for (i = cell_cols - 1; i < cell_rows * cell_cols; i--) {
                         if (cells[i].ch) {
-                                chars++;
-                                send_cell_key(i);
+                                keys[chars++] = cells[i].ch;
+                                commit_cell(i);
                         }
                         if (i % cell_cols == 0)
                                 i += cell_cols * 2;
@@ -1867,12 +2558,14 @@ int cell_widget_insert(void)
                 for (i = 0; i < cell_rows * cell_cols; i++) {
                         if (!cells[i].ch)
                                 continue;
-                        chars++;
-                        send_cell_key(i);
+                        keys[chars++] = cells[i].ch;
+                        commit_cell(i);
                 }
 
         /* If nothing was entered, send Enter key event */
         if (!chars) {
+                g_free(keys);
+                key_event_update_mappings();
                 key_event_send_enter();
                 return FALSE;
         }
@@ -1883,6 +2576,9 @@ int cell_widget_insert(void)
                 if (cells[i].ch)
                         utf16[j++] = cells[i].ch;
         utf16[j] = 0;
+#ifndef DISABLE_WORDFREQ
+        wordfreq_learn(utf16);
+#endif
 
         /* If this text has been entered before, consume that history slot */
         slot = HISTORY_MAX - 1;
@@ -1898,7 +2594,16 @@ int cell_widget_insert(void)
         memmove(history + 1, history, sizeof (*history) * slot);
         history[0] = utf16;
 
+        /* Clear the cells before sending so that anything written while
+           the keys are sent goes into fresh cells */
         cell_widget_clear();
+
+        /* Send the key events all at once */
+        inserting = TRUE;
+        key_event_update_mappings();
+        key_event_send_string(keys, chars);
+        inserting = FALSE;
+        g_free(keys);
         return TRUE;
 }
 
@@ -2109,6 +2814,7 @@ void cell_widget_cleanup(void)
                 g_object_unref(pixmap_gc);
         if (cairo)
                 cairo_destroy(cairo);
+        clear_glyphs();
         if (pango)
                 g_object_unref(pango);
 }
@@ -59,8 +59,14 @@ extern int profile_line, profile_read_only;
 
 const char *profile_read(void);
 int profile_write(const char *str);
+int profile_write_int(int value, int width);
 int profile_sync_int(int *var);
 int profile_sync_short(short *var);
+void save_profile(void);
+void compact_profile(void);
+int journal_begin(void);
+void journal_end(void);
+int journal_flush(void);
 
 /*
         Window
@@ -87,6 +93,7 @@ void window_hide(void);
 void window_toggle(void);
 void window_pack(void);
 void window_update_colors(void);
+void window_insert(void);
 void window_set_docked(int mode);
 void unicode_block_toggle(int block, int on);
 void blocks_sync(void);
@@ -24,6 +24,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "keys.h"
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
@@ -36,6 +39,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 /* Define this to print key events without actually generating them */
 /* #define DEBUG_KEY_EVENTS */
 
+/* Maximum number of characters sent with one keyboard mapping change */
+#define BATCH_MAX 256
+
+/* Seconds to wait for the focused window to ask for pasted text before
+   typing it instead, and to wait for any more requests after that */
+#define PASTE_TIMEOUT 0.5
+#define PASTE_LINGER 0.1
+
 /* Note about libfakekey: this library does very much the same thing as this
    code and is now packaged in Ubuntu. However, it is hardcoded to "recycle"
    only 10 keycodes rather than cycling through all unused keys as this code
@@ -43,6 +54,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
    handwrites a long paragraph of Unicode characters, we want to be able to
    accomodate as many as we can. */
 
+/* Everything we type leaves through an output sink. The XTest sink generates
+   real key events, text sinks write the characters out as UTF-8 and do not
+   touch the keyboard mapping. */
+typedef struct {
+        const char *name;
+        void (*press)(KeyEvent *key_event);
+        void (*release)(KeyEvent *key_event);
+        void (*send_string)(const gunichar *string, int len);
+        void (*send_enter)(void);
+        void (*write)(const char *text, int bytes);
+} KeySink;
+
+static const KeySink *key_sink;
+
 /*
         X11 KeyCodes
 */
@@ -56,10 +81,67 @@ enum {
 };
 
 static char usable[256], pressed[256];
-static int key_min, key_max, key_offset, key_codes;
+static int key_min, key_max, key_codes;
+static unsigned int key_used[256], key_time;
 static KeySym *keysyms = NULL;
 static XModifierKeymap *modmap = NULL;
 
+/* KeySyms in the mapping, each maps to the first KeyCode that generates it.
+   The KeyCode is stored shifted left by one with the low bit set if Shift
+   has to be held, plus one so that it is never zero. */
+static GHashTable *keysym_table = NULL;
+
+static void keysym_table_add(int keycode)
+/* Add the KeySyms of a KeyCode to the table unless they are already there */
+{
+        KeySym *entry;
+        int value;
+
+        entry = keysyms + (keycode - key_min) * key_codes;
+        if (key_codes > 1 && entry[1] != NoSymbol &&
+            !g_hash_table_lookup(keysym_table, GUINT_TO_POINTER(entry[1]))) {
+                value = (keycode << 1 | 1) + 1;
+                g_hash_table_insert(keysym_table, GUINT_TO_POINTER(entry[1]),
+                                    GINT_TO_POINTER(value));
+        }
+        if (entry[0] != NoSymbol &&
+            !g_hash_table_lookup(keysym_table, GUINT_TO_POINTER(entry[0]))) {
+                value = (keycode << 1) + 1;
+                g_hash_table_insert(keysym_table, GUINT_TO_POINTER(entry[0]),
+                                    GINT_TO_POINTER(value));
+        }
+}
+
+static void keysym_table_remove(int keycode)
+/* Remove the KeySyms of a KeyCode that is about to be overwritten */
+{
+        KeySym *entry;
+        int i, value;
+
+        entry = keysyms + (keycode - key_min) * key_codes;
+        for (i = 0; i < key_codes && i < 2; i++) {
+                if (entry[i] == NoSymbol)
+                        continue;
+                value = GPOINTER_TO_INT(g_hash_table_lookup(keysym_table,
+                                        GUINT_TO_POINTER(entry[i])));
+                if (value && (value - 1) >> 1 == keycode)
+                        g_hash_table_remove(keysym_table,
+                                            GUINT_TO_POINTER(entry[i]));
+        }
+}
+
+static void keysym_table_update(void)
+/* Rebuild the KeySym table from the mapping */
+{
+        int i;
+
+        if (keysym_table)
+                g_hash_table_destroy(keysym_table);
+        keysym_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (i = key_min; i <= key_max; i++)
+                keysym_table_add(i);
+}
+
 /* Bad keycodes: Despite having no KeySym entries, certain KeyCodes will
    generate special KeySyms even if their KeySym entries have been overwritten.
    For instance, KeyCode 204 attempts to eject the CD-ROM even if there is no
@@ -109,21 +191,19 @@ static void release_keycode(KeyCode k)
 #else
 
 static void press_keycode(KeyCode k)
-/* Called from various places to generate a key-down event */
+/* Called from various places to generate a key-down event. The caller is
+   responsible for syncing with the server. */
 {
-        if (k >= key_min && k <= key_max) {
+        if (k >= key_min && k <= key_max)
                 XTestFakeKeyEvent(GDK_DISPLAY(), k, True, 1);
-                XSync(GDK_DISPLAY(), False);
-        }
 }
 
 static void release_keycode(KeyCode k)
-/* Called from various places to generate a key-up event */
+/* Called from various places to generate a key-up event. The caller is
+   responsible for syncing with the server. */
 {
-        if (k >= key_min && k <= key_max) {
+        if (k >= key_min && k <= key_max)
                 XTestFakeKeyEvent(GDK_DISPLAY(), k, False, 1);
-                XSync(GDK_DISPLAY(), False);
-        }
 }
 
 #endif
@@ -133,6 +213,7 @@ static void type_keycode(KeyCode k)
 {
         press_keycode(k);
         release_keycode(k);
+        XSync(GDK_DISPLAY(), False);
 }
 
 static void setup_usable(void)
@@ -154,7 +235,8 @@ static void setup_usable(void)
                 usable[i] = KEY_USABLE;
                 found++;
         }
-        key_offset = 0;
+        memset(key_used, 0, sizeof (key_used));
+        key_time = 0;
 
         /* If we haven't found a usable key, it's probably because we have
            already ran once and used them all up without setting them back */
@@ -191,6 +273,7 @@ static void cleanup_usable(void)
                 XChangeKeyboardMapping(GDK_DISPLAY(), key_min, key_codes,
                                        keysyms, key_max - key_min + 1);
                 XFlush(GDK_DISPLAY());
+                keysym_table_update();
         }
         g_debug("Free'd %d KeyCode(s), %d unused, %d marked bad",
                 freed, unused, bad);
@@ -216,6 +299,7 @@ static void release_held_keys(void)
                         }
                 }
         }
+        XSync(GDK_DISPLAY(), False);
 }
 
 /*
@@ -224,10 +308,11 @@ static void release_held_keys(void)
 
 int key_overwrites = 0, key_recycles = 0,
     key_shifted = 0, key_num_locked = FALSE, key_caps_locked = FALSE,
-    key_disable_overwrite = FALSE;
+    key_disable_overwrite = FALSE, key_paste_len = 0;
+char *key_sink_name = NULL;
 
 static int alt_mask, num_lock_mask, meta_mask;
-static KeyEvent ke_shift, ke_enter, ke_num_lock, ke_caps_lock;
+static KeyEvent ke_shift, ke_enter, ke_num_lock, ke_caps_lock, ke_insert;
 
 static void reset_keyboard(void)
 /* In order to reliably predict key event behavior we need to be able to
@@ -246,12 +331,60 @@ static void reset_keyboard(void)
                 type_keycode(ke_num_lock.keycode);
 }
 
+static int key_event_find(KeyEvent *key_event, unsigned int keysym)
+/* Find the KeyCode that already generates the KeySym, returns FALSE if it is
+   not in the mapping */
+{
+#ifndef ALWAYS_OVERWRITE
+        int value;
+
+        value = GPOINTER_TO_INT(g_hash_table_lookup(keysym_table,
+                                                    GUINT_TO_POINTER(keysym)));
+        if (!value)
+                return FALSE;
+        value--;
+        key_event->keycode = value >> 1;
+        key_event->shift = value & 1;
+        key_event->keysym = keysym;
+        key_used[key_event->keycode] = ++key_time;
+        key_recycles++;
+        return TRUE;
+#else
+        return FALSE;
+#endif
+}
+
+static int key_event_overwrite(KeyEvent *key_event, unsigned int keysym)
+/* Overwrite the least recently used usable KeyCode in our copy of the
+   mapping to generate the KeySym, so that characters that are typed often
+   keep their KeyCodes. The caller has to send the changed mapping to the
+   server. Returns FALSE if there are no usable KeyCodes left. */
+{
+        int i, keycode = -1;
+
+        for (i = key_min; i <= key_max; i++)
+                if (usable[i] == KEY_USABLE && !pressed[i] &&
+                    (keycode < 0 || key_used[i] < key_used[keycode]))
+                        keycode = i;
+        if (keycode < 0)
+                return FALSE;
+        key_overwrites++;
+        key_event->keycode = keycode;
+        key_event->keysym = keysym;
+        key_event->shift = FALSE;
+        key_used[keycode] = ++key_time;
+        usable[keycode] = KEY_ALLOCATED;
+        keysym_table_remove(keycode);
+        keysyms[(keycode - key_min) * key_codes] = keysym;
+        keysyms[(keycode - key_min) * key_codes + 1] = keysym;
+        keysym_table_add(keycode);
+        return TRUE;
+}
+
 static void key_event_allocate(KeyEvent *key_event, unsigned int keysym)
 /* Either finds the KeyCode associated with the given keysym or overwrites
    a usable one to generate it */
 {
-        int i, start;
-
         /* Invalid KeySym */
         if (!keysym) {
                 key_event->keycode = -1;
@@ -259,25 +392,13 @@ static void key_event_allocate(KeyEvent *key_event, unsigned int keysym)
                 return;
         }
 
-        /* First see if our KeySym is already in the mapping */
-        key_event->shift = FALSE;
-#ifndef ALWAYS_OVERWRITE
-        for (i = 0; i <= key_max - key_min; i++) {
-                if (keysyms[i * key_codes + 1] == keysym)
-                        key_event->shift = TRUE;
-                if (keysyms[i * key_codes] == keysym || key_event->shift) {
-                        key_event->keycode = key_min + i;
-                        key_recycles++;
-
-                        /* Bump the allocation count if this is an
-                           allocateable KeyCode */
-                        if (usable[key_event->keycode] >= KEY_USABLE)
-                                usable[key_event->keycode]++;
-
-                        return;
-                }
+        /* First see if our KeySym is already in the mapping. Bump the
+           allocation count if this is an allocateable KeyCode. */
+        if (key_event_find(key_event, keysym)) {
+                if (usable[key_event->keycode] >= KEY_USABLE)
+                        usable[key_event->keycode]++;
+                return;
         }
-#endif
 
         /* Key overwrites may be disabled, in which case we're out of luck */
         if (key_disable_overwrite) {
@@ -288,32 +409,20 @@ static void key_event_allocate(KeyEvent *key_event, unsigned int keysym)
                 return;
         }
 
-        /* If not, find a usable KeyCode in the mapping */
-        for (start = key_offset++; ; key_offset++) {
-                if (key_offset > key_max - key_min)
-                        key_offset = 0;
-                if (usable[key_min + key_offset] == KEY_USABLE &&
-                    !pressed[key_min + key_offset])
-                        break;
-
-                /* If we can't find one, invalidate the event */
-                if (key_offset == start) {
-                        key_event->keycode = -1;
-                        key_event->keysym = 0;
-                        g_warning("Failed to allocate KeyCode for %s",
-                                  XKeysymToString(keysym));
-                        return;
-                }
+        /* If not, find a usable KeyCode in the mapping. If we can't find
+           one, invalidate the event. */
+        if (!key_event_overwrite(key_event, keysym)) {
+                key_event->keycode = -1;
+                key_event->keysym = 0;
+                g_warning("Failed to allocate KeyCode for %s",
+                          XKeysymToString(keysym));
+                return;
         }
-        key_overwrites++;
-        key_event->keycode = key_min + key_offset;
-        usable[key_event->keycode] = KEY_ALLOCATED;
 
         /* Modify the slot to hold our character */
-        keysyms[key_offset * key_codes] = keysym;
-        keysyms[key_offset * key_codes + 1] = keysym;
         XChangeKeyboardMapping(GDK_DISPLAY(), key_event->keycode, key_codes,
-                               keysyms + key_offset * key_codes, 1);
+                               keysyms + (key_event->keycode - key_min) *
+                               key_codes, 1);
         XSync(GDK_DISPLAY(), False);
 
         g_debug("Overwrote KeyCode %d for %s", key_event->keycode,
@@ -324,6 +433,11 @@ void key_event_new(KeyEvent *key_event, unsigned int keysym)
 /* Allocates key event */
 {
         key_event->keysym = keysym;
+        if (key_sink->write) {
+                key_event->keycode = -1;
+                key_event->shift = FALSE;
+                return;
+        }
         key_event_allocate(key_event, keysym);
 }
 
@@ -337,7 +451,7 @@ void key_event_free(KeyEvent *key_event)
         key_event->keysym = 0;
 }
 
-void key_event_press_force(KeyEvent *key_event)
+static void xtest_press(KeyEvent *key_event)
 /* Press the KeyCode specified in the event without sticky key tracking */
 {
         /* Invalid event */
@@ -360,27 +474,8 @@ void key_event_press_force(KeyEvent *key_event)
         XSync(GDK_DISPLAY(), False);
 }
 
-void key_event_press(KeyEvent *key_event)
-/* Press the KeyCode specified in the event */
-{
-        /* Track modifiers without actually using them */
-        if (key_event->keysym == XK_Shift_L ||
-            key_event->keysym == XK_Shift_R) {
-                key_shifted++;
-                return;
-        } else if (key_event->keysym == XK_Caps_Lock) {
-                key_caps_locked = !key_caps_locked;
-                return;
-        } else if (key_event->keysym == XK_Num_Lock) {
-                key_num_locked = !key_num_locked;
-                return;
-        }
-
-        key_event_press_force(key_event);
-}
-
-void key_event_release_force(KeyEvent *key_event)
-/* Press the KeyCode specified in the event without sticky key tracking */
+static void xtest_release(KeyEvent *key_event)
+/* Release the KeyCode specified in the event without sticky key tracking */
 {
         /* Invalid key event */
         if (key_event->keycode < key_min || key_event->keycode > key_max)
@@ -396,46 +491,245 @@ void key_event_release_force(KeyEvent *key_event)
         XSync(GDK_DISPLAY(), False);
 }
 
-void key_event_release(KeyEvent *key_event)
-/* Release the KeyCode specified in the event */
+/*
+        Pasting
+*/
+
+static const GtkTargetEntry paste_targets[] = {
+        { "UTF8_STRING", 0, 0 },
+        { "STRING", 0, 0 },
+        { "TEXT", 0, 0 },
+        { "COMPOUND_TEXT", 0, 0 },
+        { "text/plain;charset=utf-8", 0, 0 },
+};
+
+static char *paste_text = NULL, *paste_old_clipboard, *paste_old_primary;
+static int paste_requested;
+
+static void paste_get(GtkClipboard *clipboard, GtkSelectionData *data,
+                      guint info, char *text)
 {
-        /* Track modifiers without actually using them */
-        if (key_event->keysym == XK_Shift_L ||
-            key_event->keysym == XK_Shift_R) {
-                key_shifted--;
+        gtk_selection_data_set_text(data, text, -1);
+        paste_requested = TRUE;
+}
+
+static void paste_wait(double seconds, int until_requested)
+/* Run the main loop so that we can serve the selection, until time runs out
+   or optionally until the pasted text is requested */
+{
+        GTimer *timer;
+
+        timer = g_timer_new();
+        while (g_timer_elapsed(timer, NULL) < seconds &&
+               !(until_requested && paste_requested))
+                if (!g_main_context_iteration(NULL, FALSE))
+                        g_usleep(1000);
+        g_timer_destroy(timer);
+}
+
+static void paste_restore(GtkClipboard *clipboard, char *text)
+/* Put back text that was in a selection before we took it over */
+{
+        if (text) {
+                gtk_clipboard_set_text(clipboard, text, -1);
+                g_free(text);
+        } else
+                gtk_clipboard_clear(clipboard);
+}
+
+static void paste_finish(void)
+/* Give the selections back once we are done with them */
+{
+        if (!paste_text)
                 return;
-        }
+        paste_restore(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD),
+                      paste_old_clipboard);
+        paste_restore(gtk_clipboard_get(GDK_SELECTION_PRIMARY),
+                      paste_old_primary);
+        g_free(paste_text);
+        paste_text = NULL;
+}
 
-        key_event_release_force(key_event);
+static int key_event_paste(const gunichar *string, int len)
+/* Put the text in the CLIPBOARD and PRIMARY selections and send Shift+Insert,
+   which pastes one or the other in most applications. Returns FALSE if the
+   focused window never asked for the text, in which case nothing was entered
+   and the caller must type the text and then call paste_finish().
+
+   We keep the selections while the text is typed so that a window that
+   handles the paste late enters our text and not the old clipboard, although
+   it is then entered twice. A paste that arrives after the selections are
+   restored inserts whatever was there before.
+
+   Note that waiting runs the main loop, callers must expect to be called
+   again before this returns. */
+{
+        GtkClipboard *clipboard, *primary;
+
+        if (paste_text || ke_insert.keycode < key_min ||
+            ke_insert.keycode > key_max || pressed[ke_insert.keycode])
+                return FALSE;
+        paste_text = g_ucs4_to_utf8(string, len, NULL, NULL, NULL);
+        if (!paste_text)
+                return FALSE;
+        clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+        primary = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
+        paste_old_clipboard = gtk_clipboard_wait_for_text(clipboard);
+        paste_old_primary = gtk_clipboard_wait_for_text(primary);
+        gtk_clipboard_set_with_data(clipboard, paste_targets,
+                                    G_N_ELEMENTS(paste_targets),
+                                    (GtkClipboardGetFunc)paste_get, NULL,
+                                    paste_text);
+        gtk_clipboard_set_with_data(primary, paste_targets,
+                                    G_N_ELEMENTS(paste_targets),
+                                    (GtkClipboardGetFunc)paste_get, NULL,
+                                    paste_text);
+
+        /* Send the paste chord and wait for the text to be taken */
+        paste_requested = FALSE;
+        press_keycode(ke_shift.keycode);
+        press_keycode(ke_insert.keycode);
+        release_keycode(ke_insert.keycode);
+        release_keycode(ke_shift.keycode);
+        XSync(GDK_DISPLAY(), False);
+        paste_wait(PASTE_TIMEOUT, TRUE);
+        if (!paste_requested) {
+                g_debug("Paste was not accepted, typing %d characters", len);
+                return FALSE;
+        }
+        paste_wait(PASTE_LINGER, FALSE);
+        paste_finish();
+        return TRUE;
 }
 
 #ifdef X_HAVE_UTF8_STRING
-void key_event_send_char(int unichar)
+static unsigned int unichar_keysym(gunichar unichar)
+/* Get the KeySym for a Unicode character. This is what XStringToKeysym()
+   returns for "U" followed by the code point in hex. */
 {
-        KeyEvent key_event;
-        KeySym keysym;
+        if (unichar < 0x20 || (unichar > 0x7e && unichar < 0xa0) ||
+            unichar > 0x10ffff)
+                return NoSymbol;
+        if (unichar < 0x100)
+                return unichar;
+        return unichar | 0x01000000;
+}
 
-        /* Get the keysym for the unichar (may be unsupported) */
-        keysym = XStringToKeysym(va("U%04X", unichar));
-        if (!keysym) {
-                g_warning("XStringToKeysym failed to get Keysym for '%C'",
-                          unichar);
-                return;
+static int send_batch(const gunichar *string, int len)
+/* Send as many characters as we can allocate KeyCodes for with one mapping
+   change. Returns the number of characters consumed. */
+{
+        KeyEvent events[BATCH_MAX];
+        char pinned[256];
+        int i, j, first = key_max + 1, last = key_min - 1;
+
+        memset(pinned, 0, sizeof (pinned));
+        for (i = 0; i < len && i < BATCH_MAX; i++) {
+                unsigned int keysym;
+
+                events[i].keycode = -1;
+                events[i].keysym = 0;
+                keysym = unichar_keysym(string[i]);
+                if (!keysym) {
+                        g_warning("No KeySym for '%C'", string[i]);
+                        continue;
+                }
+
+                /* KeyCodes we find are pinned once like allocations so that
+                   they are not overwritten later in the same batch */
+                if (key_event_find(events + i, keysym)) {
+                        if (usable[events[i].keycode] >= KEY_USABLE &&
+                            !pinned[events[i].keycode]) {
+                                usable[events[i].keycode]++;
+                                pinned[events[i].keycode] = TRUE;
+                        }
+                        continue;
+                }
+                if (key_disable_overwrite) {
+                        g_warning("Not allowed to overwrite KeyCode for %s",
+                                  XKeysymToString(keysym));
+                        continue;
+                }
+
+                /* When we run out of KeyCodes, send what we have and reuse
+                   them for the rest of the string */
+                if (!key_event_overwrite(events + i, keysym)) {
+                        if (i > 0)
+                                break;
+                        g_warning("Failed to allocate KeyCode for %s",
+                                  XKeysymToString(keysym));
+                        continue;
+                }
+                pinned[events[i].keycode] = TRUE;
+                if (events[i].keycode < first)
+                        first = events[i].keycode;
+                if (events[i].keycode > last)
+                        last = events[i].keycode;
+        }
+
+        /* Send all of the KeyCodes we overwrote as one mapping change */
+        if (first <= last) {
+                XChangeKeyboardMapping(GDK_DISPLAY(), first, key_codes,
+                                       keysyms + (first - key_min) * key_codes,
+                                       last - first + 1);
+                XSync(GDK_DISPLAY(), False);
+                g_debug("Overwrote KeyCodes %d-%d", first, last);
+        }
+
+        /* Stream the key events and only wait for the server at the end */
+        for (j = 0; j < i; j++) {
+                if (events[j].keycode < key_min ||
+                    events[j].keycode > key_max || pressed[events[j].keycode])
+                        continue;
+                if (events[j].shift)
+                        press_keycode(ke_shift.keycode);
+                press_keycode(events[j].keycode);
+                release_keycode(events[j].keycode);
+                if (events[j].shift)
+                        release_keycode(ke_shift.keycode);
+        }
+        XSync(GDK_DISPLAY(), False);
+
+        /* The KeyCodes we overwrote keep their KeySyms so that they can be
+           recycled, changing them back now could change the meaning of
+           events that clients have not translated yet */
+        for (j = key_min; j <= key_max; j++)
+                if (pinned[j] && usable[j] > KEY_USABLE)
+                        usable[j]--;
+        return i;
+}
+
+static void xtest_send_string(const gunichar *string, int len)
+/* Send a string of characters as key events. Long strings are pasted if we
+   are allowed to. */
+{
+        int pasting = FALSE;
+
+        if (key_paste_len > 0 && len >= key_paste_len && !paste_text) {
+                if (key_event_paste(string, len))
+                        return;
+                pasting = TRUE;
         }
+        while (len > 0) {
+                int sent;
 
-        key_event_new(&key_event, keysym);
-        key_event_press(&key_event);
-        key_event_release(&key_event);
-        key_event_free(&key_event);
+                sent = send_batch(string, len);
+                string += sent;
+                len -= sent;
+        }
+        if (pasting)
+                paste_finish();
 }
+
 #else
 #warning X_HAVE_UTF8_STRING is undefined, Unicode support is disabled!
-void key_event_send_char(int unichar)
+static void xtest_send_char(gunichar unichar)
 {
         KeyCode keycode;
 
-        /* Get the keycode for an existing key */
-        keycode = XKeysymToKeycode(GDK_DISPLAY(), keysym);
+        /* Get the keycode for an existing key, Latin-1 KeySyms are the same
+           as their code points */
+        keycode = XKeysymToKeycode(GDK_DISPLAY(), unichar);
         if (!keycode) {
                 g_warning("XKeysymToKeycode failed to find KeyCode for '%C'",
                           unichar);
@@ -444,13 +738,224 @@ void key_event_send_char(int unichar)
 
         type_keycode(keycode);
 }
+
+static void xtest_send_string(const gunichar *string, int len)
+{
+        int i, pasting = FALSE;
+
+        if (key_paste_len > 0 && len >= key_paste_len && !paste_text) {
+                if (key_event_paste(string, len))
+                        return;
+                pasting = TRUE;
+        }
+        for (i = 0; i < len; i++)
+                xtest_send_char(string[i]);
+        if (pasting)
+                paste_finish();
+}
 #endif
 
-void key_event_send_enter()
+static void xtest_send_enter(void)
 {
         type_keycode(ke_enter.keycode);
 }
 
+static const KeySink sink_xtest = {
+        "xtest", xtest_press, xtest_release, xtest_send_string,
+        xtest_send_enter, NULL
+};
+
+/*
+        Text sinks
+*/
+
+static int sink_fd = -1;
+
+static void text_press(KeyEvent *key_event)
+/* Write out the character a key would type, other keys are ignored */
+{
+        gunichar unichar;
+        char buf[6];
+
+        if (key_event->keysym == XK_Return ||
+            key_event->keysym == XK_KP_Enter) {
+                key_sink->send_enter();
+                return;
+        }
+        unichar = gdk_keyval_to_unicode(key_event->keysym);
+        if (!unichar) {
+                g_debug("Text sink ignored %s",
+                        XKeysymToString(key_event->keysym));
+                return;
+        }
+        key_sink->write(buf, g_unichar_to_utf8(unichar, buf));
+}
+
+static void text_release(KeyEvent *key_event)
+{
+}
+
+static void text_send_string(const gunichar *string, int len)
+{
+        char *text;
+        glong bytes;
+
+        text = g_ucs4_to_utf8(string, len, NULL, &bytes, NULL);
+        if (!text) {
+                g_warning("Text sink failed to convert %d characters", len);
+                return;
+        }
+        key_sink->write(text, bytes);
+        g_free(text);
+}
+
+static void text_send_enter(void)
+{
+        key_sink->write("\n", 1);
+}
+
+static int file_open(void)
+/* Open the output file or FIFO without blocking. Opening a FIFO fails until
+   someone is reading from it, so we keep trying every time we write. */
+{
+        if (sink_fd >= 0)
+                return TRUE;
+        sink_fd = open(key_sink_name, O_WRONLY | O_APPEND | O_CREAT |
+                                      O_NONBLOCK, 0644);
+        if (sink_fd < 0) {
+                if (errno != ENXIO)
+                        log_errno("Failed to open output");
+                return FALSE;
+        }
+        g_debug("Opened output '%s'", key_sink_name);
+        return TRUE;
+}
+
+static void file_write(const char *text, int bytes)
+/* Text is written unbuffered, whoever is reading a pipe wants it right away.
+   If nobody is reading or the pipe is full, the text is dropped rather than
+   blocking the interface. */
+{
+        if (!file_open())
+                return;
+        while (bytes > 0) {
+                ssize_t written;
+
+                written = write(sink_fd, text, bytes);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EPIPE) {
+                                g_debug("Output reader went away");
+                                if (sink_fd != STDOUT_FILENO) {
+                                        close(sink_fd);
+                                        sink_fd = -1;
+                                }
+                        } else if (errno == EAGAIN)
+                                g_debug("Output is full, dropped %d bytes",
+                                        bytes);
+                        else
+                                log_errno("Failed to write to output");
+                        return;
+                }
+                text += written;
+                bytes -= written;
+        }
+}
+
+static const KeySink sink_text_file = {
+        "file", text_press, text_release, text_send_string,
+        text_send_enter, file_write
+};
+
+static void key_sink_open(void)
+/* Select the output sink named on the command line */
+{
+        key_sink = &sink_xtest;
+        if (!key_sink_name || !strcmp(key_sink_name, "xtest"))
+                return;
+        if (!strcmp(key_sink_name, "stdout")) {
+                sink_fd = STDOUT_FILENO;
+                key_sink = &sink_text_file;
+        } else {
+                file_open();
+                key_sink = &sink_text_file;
+        }
+        g_debug("Sending text to %s output", key_sink->name);
+}
+
+static void key_sink_close(void)
+{
+        if (sink_fd >= 0 && sink_fd != STDOUT_FILENO)
+                close(sink_fd);
+        sink_fd = -1;
+}
+
+/*
+        Sending keys
+*/
+
+void key_event_press(KeyEvent *key_event)
+/* Press the KeyCode specified in the event */
+{
+        /* Track modifiers without actually using them */
+        if (key_event->keysym == XK_Shift_L ||
+            key_event->keysym == XK_Shift_R) {
+                key_shifted++;
+                return;
+        } else if (key_event->keysym == XK_Caps_Lock) {
+                key_caps_locked = !key_caps_locked;
+                return;
+        } else if (key_event->keysym == XK_Num_Lock) {
+                key_num_locked = !key_num_locked;
+                return;
+        }
+
+        key_sink->press(key_event);
+}
+
+void key_event_release(KeyEvent *key_event)
+/* Release the KeyCode specified in the event */
+{
+        /* Track modifiers without actually using them */
+        if (key_event->keysym == XK_Shift_L ||
+            key_event->keysym == XK_Shift_R) {
+                key_shifted--;
+                return;
+        }
+
+        key_sink->release(key_event);
+}
+
+void key_event_press_force(KeyEvent *key_event)
+/* Press the key without sticky key tracking */
+{
+        key_sink->press(key_event);
+}
+
+void key_event_release_force(KeyEvent *key_event)
+/* Release the key without sticky key tracking */
+{
+        key_sink->release(key_event);
+}
+
+void key_event_send_string(const gunichar *string, int len)
+{
+        key_sink->send_string(string, len);
+}
+
+void key_event_send_char(int unichar)
+{
+        gunichar ch = unichar;
+
+        key_sink->send_string(&ch, 1);
+}
+
+void key_event_send_enter(void)
+{
+        key_sink->send_enter();
+}
+
 void key_event_update_mappings(void)
 {
         int i, j;
@@ -461,6 +966,7 @@ void key_event_update_mappings(void)
                 XFree(keysyms);
         keysyms = XGetKeyboardMapping(GDK_DISPLAY(), key_min,
                                       key_max - key_min + 1, &key_codes);
+        keysym_table_update();
 
         /* Get the modifier mapping and variable masks */
         if (modmap)
@@ -489,7 +995,8 @@ void key_event_update_mappings(void)
                 }
 
         /* Release any keys pressed by the user */
-        reset_keyboard();
+        if (!key_sink->write)
+                reset_keyboard();
 }
 
 int key_event_init(void)
@@ -500,6 +1007,11 @@ int key_event_init(void)
         g_warning("Compiled without Unicode support!");
 #endif
 
+        /* Text sinks do not need the keyboard at all */
+        key_sink_open();
+        if (key_sink->write)
+                return 0;
+
 	/* Make sure Xtest is supported */
 	if(!XTestQueryExtension(GDK_DISPLAY(), &a, &b, &c, &d))
 		g_critical("Xtest not supported!");
@@ -520,11 +1032,15 @@ int key_event_init(void)
         key_event_allocate(&ke_caps_lock, XK_Caps_Lock);
         key_event_allocate(&ke_num_lock, XK_Num_Lock);
         key_event_allocate(&ke_enter, XK_Return);
+        key_event_allocate(&ke_insert, XK_Insert);
 
         return 0;
 }
 
 void key_event_cleanup(void)
 {
-        cleanup_usable();
+        if (key_sink->write)
+                key_sink_close();
+        else
+                cleanup_usable();
 }
@@ -38,6 +38,7 @@ void key_event_press_force(KeyEvent *key_event);
 void key_event_release(KeyEvent *key_event);
 void key_event_release_force(KeyEvent *key_event);
 void key_event_send_char(int unichar);
+void key_event_send_string(const gunichar *string, int len);
 void key_event_send_enter(void);
 void key_event_update_mappings(void);
 
@@ -27,6 +27,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <signal.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 /* recognize.c */
 extern int strength_sum;
@@ -35,8 +38,18 @@ void recognize_init(void);
 void recognize_sync(void);
 void samples_write(void);
 void sample_read(void);
+void sample_packed_read(void);
 void update_enabled_samples(void);
 int samples_loaded(void);
+int samples_point_bytes(void);
+void journal_sample_read(void);
+void journal_sample_packed_read(void);
+void journal_untrain_read(void);
+void journal_promote_read(void);
+void journal_demote_read(void);
+
+/* stroke.c */
+void stroke_heap(int *live, int *reserved);
 
 /* cellwidget.c */
 extern int training, corrections, rewrites, characters, inputs;
@@ -46,8 +59,12 @@ void cell_widget_cleanup(void);
 /* options.c */
 void options_sync(void);
 
+/* wordfreq.c */
+void wordfreq_sync(void);
+
 /* keyevent.c */
 extern int key_recycles, key_overwrites, key_disable_overwrite;
+extern char *key_sink_name;
 
 int key_event_init(void);
 void key_event_cleanup(void);
@@ -240,12 +257,27 @@ void highlight_gdk_color(const GdkColor *base, GdkColor *out, double value)
 /* Added to the end of the profile backup filename */
 #define BACKUP_POSTFIX ".backup"
 
+/* Added to the end of the profile filename while it is being written */
+#define TEMP_POSTFIX ".tmp"
+
+/* Initial size of the profile output buffer in bytes */
+#define PROFILE_OUT_SIZE (256 * 1024)
+
+/* Added to the end of the profile filename for the training journal */
+#define JOURNAL_POSTFIX ".journal"
+
+/* When the training journal grows past this many bytes, the profile is
+   compacted in the background and the journal is started over */
+#define JOURNAL_MAX (512 * 1024)
+
 int profile_read_only, keyboard_only = FALSE;
 
 static GIOChannel *channel;
 static char profile_buf[4096], *profile_end = NULL, profile_swap,
-            *force_profile = NULL;
-static int force_read_only;
+            *force_profile = NULL, *profile_path = NULL, *profile_out = NULL;
+static int force_read_only, profile_writing = FALSE, profile_out_len,
+           profile_out_size, journal_fd = -1, journal_len, journal_serial = 0,
+           journal_saved = 0;
 
 static int is_space(int ch)
 {
@@ -266,6 +298,12 @@ static int profile_open_channel(const char *type, const char *path)
         channel = g_io_channel_new_file(path, profile_read_only ? "r" : "w",
                                         &error);
         if (!error) {
+
+                /* Start reading from an empty buffer */
+                profile_end = NULL;
+                profile_buf[0] = 0;
+                profile_swap = 0;
+
                 g_debug("Opened %s profile '%s' for %s",
                         type, path, profile_read_only ? "reading" : "writing");
                 return TRUE;
@@ -408,57 +446,150 @@ static int move_file(char *from, char *to)
         return TRUE;
 }
 
-static int profile_open_write(void)
-/* Open a temporary profile file for writing. Returns TRUE if the profile was
-   opened successfully. */
+static char *profile_user_path(void)
+/* Returns the path the profile is saved to, free it with g_free() */
 {
-        GError *error;
-        char *path;
-        char *backup_path;
+        /* Use command-line specified profile path first then the user's
+           home directory profile */
+        if (force_profile)
+                return g_strdup(force_profile);
+        return g_build_filename(g_get_home_dir(), "." PACKAGE,
+                                PROFILE_FILENAME, NULL);
+}
+
+static void profile_out_reset(void)
+/* Empty the output buffer. It is allocated once and reused on every save. */
+{
+        if (!profile_out) {
+                profile_out_size = PROFILE_OUT_SIZE;
+                profile_out = g_malloc(profile_out_size);
+        }
+        profile_out_len = 0;
+}
 
+static int profile_open_write(void)
+/* Prepare the profile output buffer. Nothing touches the disk until the
+   profile is closed. Returns TRUE if the profile can be written. */
+{
         if (force_read_only) {
                 g_debug("Not saving profile, opened in read-only mode");
                 return FALSE;
         }
         profile_read_only = FALSE;
+        g_free(profile_path);
+        profile_path = profile_user_path();
+        profile_out_reset();
+        profile_writing = TRUE;
+        return TRUE;
+}
 
-        /* Use command-line specified profile path first then the user's
-           home directory profile */
-        path = force_profile;
-        if (!path)
-                path = g_build_filename(g_get_home_dir(),
-                                        "." PACKAGE, PROFILE_FILENAME, NULL);
+static int sync_path(const char *path, int directory)
+/* Flush a file or a directory entry to disk. Returns TRUE on success. */
+{
+        int fd, result;
 
-        /* Backup the current profile, if it exists */
-        if (g_file_test(path, G_FILE_TEST_IS_REGULAR) &&
-            g_file_test(path, G_FILE_TEST_EXISTS)) {
-                backup_path = g_strconcat(path, BACKUP_POSTFIX, NULL);
-                if (!move_file(path, backup_path))
-                        g_warning("Failed to backup the profile");
+        fd = open(path, directory ? O_RDONLY : O_WRONLY);
+        if (fd < 0)
+                return FALSE;
+        result = fsync(fd);
+        close(fd);
+        return !result;
+}
+
+static int profile_commit(void)
+/* Write the output buffer to a temporary file, flush it to disk and rename it
+   over the profile. The old profile is kept as the backup. Returns TRUE if
+   the profile was saved. */
+{
+        char *tmp_path, *backup_path, *dir_path;
+        const char *p;
+        int fd, left;
+
+        tmp_path = g_strconcat(profile_path, TEMP_POSTFIX, NULL);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                log_errno(va("Failed to open temporary profile '%s'",
+                             tmp_path));
+                g_free(tmp_path);
+                return FALSE;
+        }
+
+        /* Write the whole buffer out */
+        for (p = profile_out, left = profile_out_len; left > 0; ) {
+                ssize_t written;
+
+                written = write(fd, p, left);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_errno("Failed to write profile");
+                        close(fd);
+                        remove(tmp_path);
+                        g_free(tmp_path);
+                        return FALSE;
+                }
+                p += written;
+                left -= written;
+        }
+        if (fsync(fd)) {
+                log_errno("Failed to flush profile to disk");
+                close(fd);
+                remove(tmp_path);
+                g_free(tmp_path);
+                return FALSE;
+        }
+        if (close(fd)) {
+                log_errno("Failed to close temporary profile");
+                remove(tmp_path);
+                g_free(tmp_path);
+                return FALSE;
+        }
+
+        /* Keep the current profile as the backup. A hard link leaves the
+           profile in place so there is never a moment without one, but not
+           every filesystem supports them. */
+        if (g_file_test(profile_path, G_FILE_TEST_IS_REGULAR)) {
+                backup_path = g_strconcat(profile_path, BACKUP_POSTFIX, NULL);
+                remove(backup_path);
+                if (!link(profile_path, backup_path) ||
+                    move_file(profile_path, backup_path))
+                        g_debug("Backed up profile '%s' to '%s'",
+                                profile_path, backup_path);
                 else
-                        g_debug("Backed up profile '%s' to '%s'", path,
-                                backup_path);
+                        g_warning("Failed to backup the profile");
                 g_free(backup_path);
-        } else {
-          g_debug("No profile found, not backing up");
-        }
+        } else
+                g_debug("No profile found, not backing up");
 
-        /* Open user's profile */
-        if (profile_open_channel("user's", path)) {
-                g_free(path);
-                return TRUE;
+        /* Atomically replace the profile */
+        if (rename(tmp_path, profile_path)) {
+                log_errno("Failed to rename temporary profile");
+                g_free(tmp_path);
+                return FALSE;
         }
-        g_free(path);
-        g_warning("Failed to open profile for writing: %s", error->message);
-        return FALSE;
+        g_free(tmp_path);
+
+        /* Make sure the rename itself reaches the disk */
+        dir_path = g_path_get_dirname(profile_path);
+        if (!sync_path(dir_path, TRUE))
+                g_debug("Failed to flush profile directory '%s'", dir_path);
+        g_free(dir_path);
+
+        return TRUE;
 }
 
 static int profile_close(void)
-/* Close the currently open profile */
+/* Close the currently open profile, committing it to disk if it was opened
+   for writing */
 {
+        if (profile_writing) {
+                profile_writing = FALSE;
+                return profile_commit();
+        }
         if (!channel)
                 return FALSE;
         g_io_channel_unref(channel);
+        channel = NULL;
         return TRUE;
 }
 
@@ -541,22 +672,66 @@ int profile_read_next(void)
         return FALSE;
 }
 
+static void profile_reserve(int len)
+/* Make sure the output buffer has room for len more bytes */
+{
+        if (profile_out_len + len <= profile_out_size)
+                return;
+        while (profile_out_len + len > profile_out_size)
+                profile_out_size *= 2;
+        profile_out = g_realloc(profile_out, profile_out_size);
+}
+
 int profile_write(const char *str)
 /* Write a string to the open profile */
 {
-        GError *error = NULL;
-        gsize bytes_written;
+        int len;
 
         if (profile_read_only || !str)
                 return 0;
-        if (!channel)
+        if (!profile_writing)
                 return 1;
-        g_io_channel_write_chars(channel, str, strlen(str), &bytes_written,
-                                 &error);
-        if (error) {
-                g_warning("Write error: %s", error->message);
+        len = strlen(str);
+        profile_reserve(len);
+        memcpy(profile_out + profile_out_len, str, len);
+        profile_out_len += len;
+        return 0;
+}
+
+int profile_write_int(int value, int width)
+/* Write a space and then an integer right-aligned to at least width
+   characters to the open profile. Equivalent to va(" %*d", width, value) but
+   this is called for every point of every sample so it avoids printf. */
+{
+        char digits[12], *out;
+        unsigned int n;
+        int len, pad;
+
+        if (profile_read_only)
+                return 0;
+        if (!profile_writing)
                 return 1;
-        }
+
+        /* Convert to digits in reverse */
+        n = value < 0 ? -(unsigned int)value : (unsigned int)value;
+        len = 0;
+        do {
+                digits[len++] = '0' + n % 10;
+                n /= 10;
+        } while (n);
+        if (value < 0)
+                digits[len++] = '-';
+
+        /* Space and padding */
+        pad = width > len ? width - len : 0;
+        profile_reserve(1 + pad + len);
+        out = profile_out + profile_out_len;
+        *out++ = ' ';
+        for (; pad > 0; pad--)
+                *out++ = ' ';
+        while (len > 0)
+                *out++ = digits[--len];
+        profile_out_len = out - profile_out;
         return 0;
 }
 
@@ -576,7 +751,7 @@ int profile_sync_int(int *var)
                         }
                 }
         } else
-                return profile_write(va(" %d", *var));
+                return profile_write_int(*var, 0);
         return 1;
 }
 
@@ -603,6 +778,337 @@ void version_read(void)
                           "(expected %d)", version, PROFILE_VERSION);
 }
 
+typedef struct {
+        const char *name;
+        void (*read_func)(void);
+        void (*write_func)(void);
+} ProfileCommand;
+
+static int profile_parse(const ProfileCommand *cmds, int num_cmds)
+/* Run the read function of every command in the open profile. Returns the
+   number of commands parsed. */
+{
+        const char *token;
+        int start = profile_line;
+
+        do {
+                int i;
+
+                token = profile_read();
+                if (!token[0]) {
+                        if (profile_read_next())
+                                continue;
+                        break;
+                }
+                for (i = 0; i < num_cmds; i++)
+                        if (!g_ascii_strcasecmp(cmds[i].name, token)) {
+                                if (cmds[i].read_func)
+                                        cmds[i].read_func();
+                                break;
+                        }
+                if (i == num_cmds)
+                        g_warning("Unrecognized profile command '%s'", token);
+                profile_line++;
+        } while (profile_read_next());
+        return profile_line - start;
+}
+
+/*
+        Training journal
+*/
+
+/* Training changes are appended to the journal as they happen so that they
+   are not lost if we are killed and so that the profile does not have to be
+   rewritten to keep them. The journal starts with a serial number. The profile
+   records the serial of the journal it was saved with and how many bytes of it
+   were already included, so anything appended while the profile was being
+   written is still replayed. Once the profile is on disk the journal is
+   started over with the next serial and only the records the profile is
+   missing. */
+
+#define NUM_JOURNAL_CMDS (sizeof (journal_cmds) / sizeof (*journal_cmds))
+
+static const ProfileCommand journal_cmds[] = {
+        { "sample",        journal_sample_read,        NULL },
+        { "sample_packed", journal_sample_packed_read, NULL },
+        { "untrain",       journal_untrain_read,       NULL },
+        { "promote",       journal_promote_read,       NULL },
+        { "demote",        journal_demote_read,        NULL },
+};
+
+static guint journal_source = 0;
+static int journal_was_read_only;
+
+/* Settings sections of the profile as they were last loaded or saved */
+static char *profile_settings = NULL;
+static int profile_settings_len;
+
+static char *journal_path(void)
+/* Returns the path of the training journal, free it with g_free() */
+{
+        char *profile, *path;
+
+        profile = profile_user_path();
+        path = g_strconcat(profile, JOURNAL_POSTFIX, NULL);
+        g_free(profile);
+        return path;
+}
+
+void journal_serial_sync(void)
+/* Sync the journal serial number and how much of that journal is included */
+{
+        profile_write("journal");
+        profile_sync_int(&journal_serial);
+        profile_sync_int(&journal_saved);
+        profile_write("\n");
+}
+
+static void journal_close(void)
+{
+        if (journal_source) {
+                g_source_remove(journal_source);
+                journal_source = 0;
+        }
+        if (journal_fd < 0)
+                return;
+        if (fsync(journal_fd))
+                log_errno("Failed to flush training journal");
+        close(journal_fd);
+        journal_fd = -1;
+}
+
+static int journal_append(const char *buf, int len)
+/* Append data to the journal. If this fails the journal is closed and we go
+   back to relying on profile saves alone. */
+{
+        while (len > 0) {
+                ssize_t written;
+
+                written = write(journal_fd, buf, len);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_errno("Failed to write training journal");
+                        journal_close();
+                        return FALSE;
+                }
+                buf += written;
+                len -= written;
+                journal_len += written;
+        }
+        return TRUE;
+}
+
+static int journal_restart(int saved)
+/* Start a journal with the next serial number, carrying over the records past
+   the first saved bytes. The new journal replaces the old one atomically so
+   on failure the old one is still valid. Returns TRUE on success. */
+{
+        char *path, *tmp_path, *buf;
+        const char *header;
+        int fd, len, header_len, left, result = FALSE;
+
+        if (journal_fd < 0)
+                return FALSE;
+        if (saved > journal_len)
+                saved = journal_len;
+        header = nva(&header_len, "journal %d\n", journal_serial + 1);
+        len = header_len + journal_len - saved;
+        buf = g_malloc(len);
+        memcpy(buf, header, header_len);
+        if (pread(journal_fd, buf + header_len, len - header_len,
+                  saved) != len - header_len) {
+                log_errno("Failed to read training journal");
+                g_free(buf);
+                return FALSE;
+        }
+        path = journal_path();
+        tmp_path = g_strconcat(path, TEMP_POSTFIX, NULL);
+        fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+                log_errno(va("Failed to open training journal '%s'",
+                             tmp_path));
+                goto done;
+        }
+        for (left = len; left > 0; ) {
+                ssize_t written;
+
+                written = write(fd, buf + len - left, left);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                left -= written;
+        }
+        if (left > 0 || fsync(fd) || rename(tmp_path, path)) {
+                log_errno("Failed to start a new training journal");
+                close(fd);
+                remove(tmp_path);
+                goto done;
+        }
+        close(journal_fd);
+        journal_fd = fd;
+        journal_len = len;
+        journal_serial++;
+        result = TRUE;
+
+done:
+        g_free(tmp_path);
+        g_free(path);
+        g_free(buf);
+        return result;
+}
+
+static int journal_replay(void)
+/* Replay the journal over the samples loaded from the profile. Returns TRUE
+   if the journal belongs to the loaded profile and can be appended to. */
+{
+        GError *error = NULL;
+        char *path;
+        int records, serial;
+
+        path = journal_path();
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+                g_free(path);
+                return FALSE;
+        }
+        profile_read_only = TRUE;
+        if (!profile_open_channel("training journal", path)) {
+                g_free(path);
+                return FALSE;
+        }
+        serial = -1;
+        if (!g_ascii_strcasecmp(profile_read(), "journal"))
+                serial = atoi(profile_read());
+
+        /* The journal the profile was saved with may have been started over
+           with only the records the profile is missing */
+        if (serial >= 0 && serial == journal_serial + 1) {
+                journal_serial = serial;
+                journal_saved = 0;
+        }
+        if (serial < 0 || serial != journal_serial) {
+                g_warning("Training journal '%s' does not belong to the "
+                          "loaded profile, discarding it", path);
+                profile_close();
+                g_free(path);
+                return FALSE;
+        }
+
+        /* Skip the records the profile already includes */
+        if (journal_saved > 0) {
+                g_io_channel_seek_position(channel, journal_saved, G_SEEK_SET,
+                                           &error);
+                if (error) {
+                        g_warning("Failed to seek training journal '%s': %s",
+                                  path, error->message);
+                        g_error_free(error);
+                        profile_close();
+                        g_free(path);
+                        return FALSE;
+                }
+                profile_end = NULL;
+                profile_buf[0] = 0;
+                profile_swap = 0;
+        } else
+                profile_read_next();
+        g_free(path);
+        profile_line = 2;
+        records = profile_parse(journal_cmds, NUM_JOURNAL_CMDS);
+        profile_close();
+        g_debug("Replayed %d training journal records", records);
+        return TRUE;
+}
+
+static gboolean journal_idle(void)
+/* Flush the journal to disk once the burst of training is over or compact it
+   into the profile if it has grown too large */
+{
+        journal_source = 0;
+        if (journal_fd < 0)
+                return FALSE;
+        if (journal_len > JOURNAL_MAX) {
+                g_debug("Training journal is %d bytes, compacting profile",
+                        journal_len);
+                compact_profile();
+        }
+        if (journal_fd >= 0 && fsync(journal_fd))
+                log_errno("Failed to flush training journal");
+        return FALSE;
+}
+
+static void journal_open(int replayed)
+/* Open the journal for appending. If the journal was not replayed a new one
+   is started. */
+{
+        char *path;
+        char last;
+
+        if (force_read_only || window_embedded)
+                return;
+        path = journal_path();
+        journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (journal_fd < 0) {
+                log_errno(va("Failed to open training journal '%s'", path));
+                g_free(path);
+                return;
+        }
+        g_free(path);
+        if (!replayed) {
+                journal_len = 0;
+                if (!journal_restart(0))
+                        journal_close();
+                return;
+        }
+
+        /* If we were killed in the middle of a record, make sure the next
+           record starts on a new line */
+        journal_len = lseek(journal_fd, 0, SEEK_END);
+        if (journal_len > 0 && pread(journal_fd, &last, 1,
+                                     journal_len - 1) == 1 && last != '\n')
+                journal_append("\n", 1);
+
+        /* A journal that was left too large is compacted once we are idle */
+        if (journal_len > JOURNAL_MAX)
+                journal_source = g_idle_add((GSourceFunc)journal_idle, NULL);
+}
+
+int journal_begin(void)
+/* Start writing a journal record with the profile write functions. Returns
+   FALSE if there is no journal to write to. */
+{
+        if (journal_fd < 0 || profile_writing)
+                return FALSE;
+        journal_was_read_only = profile_read_only;
+        profile_read_only = FALSE;
+        profile_out_reset();
+        profile_writing = TRUE;
+        return TRUE;
+}
+
+void journal_end(void)
+/* Append the record to the journal */
+{
+        profile_writing = FALSE;
+        profile_read_only = journal_was_read_only;
+        if (!journal_append(profile_out, profile_out_len))
+                return;
+        if (!journal_source)
+                journal_source = g_idle_add((GSourceFunc)journal_idle, NULL);
+}
+
+int journal_flush(void)
+/* Make sure all journal records are on disk. Returns FALSE if there is no
+   journal. */
+{
+        if (journal_fd < 0)
+                return FALSE;
+        if (fsync(journal_fd))
+                log_errno("Failed to flush training journal");
+        return TRUE;
+}
+
 /*
         Main and signal handling
 */
@@ -616,18 +1122,17 @@ static FILE *log_file = NULL;
 static int ignore_fifo;
 
 /* Profile commands table */
-static struct {
-        const char *name;
-        void (*read_func)(void);
-        void (*write_func)(void);
-} profile_cmds[] = {
-        { "version",      version_read,      NULL               },
-        { "window",       window_sync,       window_sync        },
-        { "options",      options_sync,      options_sync       },
-        { "recognize",    recognize_sync,    recognize_sync     },
-        { "blocks",       blocks_sync,       blocks_sync        },
-        { "bad_keycodes", bad_keycodes_read, bad_keycodes_write },
-        { "sample",       sample_read,       samples_write      },
+static const ProfileCommand profile_cmds[] = {
+        { "version",       version_read,        NULL                },
+        { "journal",       journal_serial_sync, journal_serial_sync },
+        { "window",        window_sync,         window_sync         },
+        { "options",       options_sync,        options_sync        },
+        { "recognize",     recognize_sync,      recognize_sync      },
+        { "blocks",        blocks_sync,         blocks_sync         },
+        { "dictionary",    wordfreq_sync,       wordfreq_sync       },
+        { "bad_keycodes",  bad_keycodes_read,   bad_keycodes_write  },
+        { "sample",        sample_read,         samples_write       },
+        { "sample_packed", sample_packed_read,  NULL                },
 };
 
 /* Command line arguments */
@@ -658,6 +1163,8 @@ static GOptionEntry command_line_opts[] = {
           "Do not save changes to the profile", NULL },
         { "disable-overwrite", 0, 0, G_OPTION_ARG_NONE, &key_disable_overwrite,
           "Do not modify the keymap", NULL },
+        { "output", 0, 0, G_OPTION_ARG_STRING, &key_sink_name,
+          "Send text to xtest, stdout or a file/FIFO", "xtest" },
         { "ignore-fifo", 0, 0, G_OPTION_ARG_NONE, &ignore_fifo,
           "Allow starting a second instance", NULL },
 
@@ -677,17 +1184,159 @@ static int catch_signals[] = {
         -1
 };
 
+static int profile_settings_changed(void)
+/* Write every section of the profile except the journal serial and the
+   samples, which are covered by the journal, and compare it with the copy
+   from the last time we were called. Returns TRUE if anything changed or
+   there is no user profile to compare with. */
+{
+        char *path;
+        unsigned int i;
+        int changed, was_read_only, exists;
+
+        if (profile_writing)
+                return TRUE;
+        was_read_only = profile_read_only;
+        profile_read_only = FALSE;
+        profile_out_reset();
+        profile_writing = TRUE;
+        for (i = 0; i < NUM_PROFILE_CMDS; i++)
+                if (profile_cmds[i].write_func &&
+                    profile_cmds[i].write_func != journal_serial_sync &&
+                    profile_cmds[i].write_func != samples_write)
+                        profile_cmds[i].write_func();
+        profile_writing = FALSE;
+        profile_read_only = was_read_only;
+
+        /* Keep the new copy */
+        changed = !profile_settings ||
+                  profile_settings_len != profile_out_len ||
+                  memcmp(profile_settings, profile_out, profile_out_len);
+        if (changed) {
+                g_free(profile_settings);
+                profile_settings = g_memdup(profile_out, profile_out_len);
+                profile_settings_len = profile_out_len;
+        }
+
+        /* Without a user profile the samples only exist in memory */
+        path = profile_user_path();
+        exists = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+        g_free(path);
+        return changed || !exists;
+}
+
+static int profile_build(void)
+/* Write the whole profile to the output buffer. Returns FALSE if the profile
+   cannot be saved. */
+{
+        unsigned int i;
+
+        if (window_embedded || !profile_open_write())
+                return FALSE;
+
+        /* The profile includes everything in the journal so far. Without a
+           journal, whatever an earlier one left on disk must not be replayed
+           over the new profile. */
+        if (journal_fd < 0) {
+                journal_serial++;
+                journal_saved = 0;
+        } else
+                journal_saved = journal_len;
+
+        profile_write(va("version %d\n", PROFILE_VERSION));
+        for (i = 0; i < NUM_PROFILE_CMDS; i++)
+                if (profile_cmds[i].write_func)
+                        profile_cmds[i].write_func();
+        return TRUE;
+}
+
+static GPid compact_pid = 0;
+static guint compact_watch;
+static int compact_saved;
+
+static void compact_finish(int status)
+/* The child writing the profile has exited */
+{
+        compact_pid = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                g_warning("Failed to compact profile");
+                return;
+        }
+        g_debug("Profile compacted");
+        journal_restart(compact_saved);
+}
+
+static void compact_exited(GPid pid, int status)
+{
+        g_spawn_close_pid(pid);
+        compact_finish(status);
+}
+
+static void compact_wait(void)
+/* Wait for the profile being compacted to reach the disk */
+{
+        int status;
+
+        if (!compact_pid)
+                return;
+        g_source_remove(compact_watch);
+        while (waitpid(compact_pid, &status, 0) < 0)
+                if (errno != EINTR) {
+
+                        /* The journal the profile was saved with is kept, so
+                           not knowing how the child did loses nothing */
+                        log_errno("Failed to wait for profile compaction");
+                        compact_pid = 0;
+                        return;
+                }
+        compact_finish(status);
+}
+
+void compact_profile(void)
+/* Save the profile without stalling the pen. Building the profile in memory
+   is quick but writing and flushing a large one is not, so that is left to a
+   child process. Training continues to go to the journal in the meantime. */
+{
+        int *ps, result;
+
+        if (compact_pid || !profile_build())
+                return;
+        profile_writing = FALSE;
+        if (log_file)
+                fflush(log_file);
+        compact_pid = fork();
+        if (compact_pid < 0) {
+                log_errno("Failed to fork to compact profile");
+                compact_pid = 0;
+                if (profile_commit())
+                        journal_restart(journal_saved);
+                return;
+        }
+        if (!compact_pid) {
+
+                /* The child must not clean up after the parent */
+                for (ps = catch_signals; *ps != -1; ps++)
+                        signal(*ps, SIG_DFL);
+                result = profile_commit();
+                if (log_file)
+                        fflush(log_file);
+                _exit(result ? 0 : 1);
+        }
+        compact_saved = journal_saved;
+        compact_watch = g_child_watch_add(compact_pid,
+                                          (GChildWatchFunc)compact_exited,
+                                          NULL);
+}
+
 /* Save the profile */
 void save_profile(void) {
-        if (!window_embedded && profile_open_write()) {
-                unsigned int i;
-
-                profile_write(va("version %d\n", PROFILE_VERSION));
-                for (i = 0; i < NUM_PROFILE_CMDS; i++)
-                        if (profile_cmds[i].write_func)
-                                profile_cmds[i].write_func();
-                if (profile_close())
-                        g_debug("Profile saved");
+        compact_wait();
+        if (!profile_build())
+                return;
+        if (profile_close()) {
+                g_debug("Profile saved");
+                journal_restart(journal_saved);
+                profile_settings_changed();
         }
 }
 
@@ -709,7 +1358,16 @@ void cleanup(void)
         key_event_cleanup();
         if (!window_embedded)
                 single_instance_cleanup();
-        save_profile();
+
+        /* Training since the profile was saved is already in the journal, so
+           the profile is only rewritten if a setting changed. Compacting a
+           large journal is left to the next start. */
+        compact_wait();
+        if (!profile_settings_changed() && journal_flush())
+                g_debug("Settings unchanged, training kept in the journal");
+        else
+                save_profile();
+        journal_close();
 
         /* Close log file */
         if (log_file)
@@ -738,6 +1396,9 @@ static void hook_signals(void)
         }
         if (sigprocmask(SIG_UNBLOCK, &sigset, NULL) == -1)
                 log_errno("Failed to set signal blocking mask");
+
+        /* A pipe output losing its reader must not kill us */
+        signal(SIGPIPE, SIG_IGN);
 }
 
 void log_print(const char *format, ...)
@@ -844,7 +1505,6 @@ static void second_instance(char *str)
 int main(int argc, char *argv[])
 {
         GError *error;
-        const char *token;
 
         /* Initialize GTK+ */
         error = NULL;
@@ -907,34 +1567,26 @@ int main(int argc, char *argv[])
         if (profile_open_read()) {
                 profile_line = 1;
                 g_message("Parsing profile");
-                do {
-                        unsigned int i;
-
-                        token = profile_read();
-                        if (!token[0]) {
-                                if (profile_read_next())
-                                        continue;
-                                break;
-                        }
-                        for (i = 0; i < NUM_PROFILE_CMDS; i++)
-                                if (!g_ascii_strcasecmp(profile_cmds[i].name,
-                                                        token)) {
-                                        if (profile_cmds[i].read_func)
-                                                profile_cmds[i].read_func();
-                                        break;
-                                }
-                        if (i == NUM_PROFILE_CMDS)
-                                g_warning("Unrecognized profile command '%s'",
-                                          token);
-                        profile_line++;
-                } while (profile_read_next());
+                profile_parse(profile_cmds, NUM_PROFILE_CMDS);
                 profile_close();
                 g_debug("Parsed %d commands", profile_line - 1);
         }
 
+        /* Apply training that happened after the profile was last saved */
+        journal_open(journal_replay());
+        profile_settings_changed();
+
         /* After loading samples and block enabled/disabled information,
            update the samples */
         update_enabled_samples();
+        if (log_level >= G_LOG_LEVEL_DEBUG) {
+                int live, reserved;
+
+                stroke_heap(&live, &reserved);
+                g_debug("Stroke points take %d bytes, %d bytes in size "
+                        "classes, %d bytes allocated", samples_point_bytes(),
+                        live, reserved);
+        }
 
         /* Ensure that if there is a crash, data is saved properly */
         hook_signals();
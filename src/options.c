@@ -43,6 +43,9 @@ void cell_widget_enable_xinput(int on);
 extern GdkColor custom_key_color;
 extern int keyboard_size;
 
+/* keyevent.c */
+extern int key_paste_len;
+
 void key_widget_update_colors(void);
 
 /* statusicon.c */
@@ -81,6 +84,9 @@ void options_sync(void)
         profile_sync_int(&xinput_enabled);
         profile_sync_int(&style_colors);
         profile_sync_int(&status_menu_left_click);
+        profile_sync_int(&compact_samples);
+        profile_sync_int(&learn_words);
+        profile_sync_int(&key_paste_len);
         profile_write("\n");
 }
 
@@ -506,6 +512,23 @@ static void create_dialog(void)
         gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 0);
         gtk_box_pack_start(GTK_BOX(vbox2), hbox, FALSE, FALSE, 0);
 
+        /* View -> Window -> Paste */
+        hbox = gtk_hbox_new(FALSE, 0);
+        gtk_box_pack_start(GTK_BOX(hbox), spacer_new(16, -1), FALSE, FALSE, 0);
+        w = label_new_markup("Paste text with at least ");
+        gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 0);
+        w = spin_button_new_int(0, 9999, &key_paste_len, FALSE);
+        gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 0);
+        gtk_tooltips_set_tip(tooltips, w,
+                             "Long text is entered by pasting it with "
+                             "Shift+Insert instead of typing it one key at a "
+                             "time. The clipboard is restored afterwards. If "
+                             "the window does not take the text, it is typed "
+                             "instead. Set to zero to always type.", NULL);
+        w = label_new_markup(" characters");
+        gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 0);
+        gtk_box_pack_start(GTK_BOX(vbox2), hbox, FALSE, FALSE, 0);
+
         /* View -> Status icon */
         gtk_box_pack_start(GTK_BOX(vbox2), spacer_new(-1, 8), FALSE, FALSE, 0);
         w = label_new_markup("<b>Status icon</b>");
@@ -626,6 +649,19 @@ static void create_dialog(void)
                              "too slow or the program uses too much memory.",
                              NULL);
 
+        /* Recognition -> Samples -> Compact */
+        hbox = gtk_hbox_new(FALSE, 0);
+        gtk_box_pack_start(GTK_BOX(hbox), spacer_new(16, -1), FALSE, FALSE, 0);
+        w = check_button_new("Save samples in compact format",
+                             &compact_samples, FALSE);
+        gtk_box_pack_start(GTK_BOX(hbox), w, TRUE, TRUE, 0);
+        gtk_box_pack_start(GTK_BOX(vbox2), hbox, FALSE, FALSE, 0);
+        gtk_tooltips_set_tip(tooltips, w,
+                             "Store training samples in a packed format that "
+                             "makes the profile several times smaller and "
+                             "faster to load. Older versions of "
+                             PACKAGE_NAME " cannot read it.", NULL);
+
         /* Recognition -> Word context */
         gtk_box_pack_start(GTK_BOX(vbox2), spacer_new(-1, 8), FALSE, FALSE, 0);
         w = label_new_markup("<b>Word context</b>");
@@ -644,6 +680,21 @@ static void create_dialog(void)
                              "consistent recognition of numbers and "
                              "capitalization.", NULL);
 
+        /* Recognition -> Word context -> Learn words */
+        hbox = gtk_hbox_new(FALSE, 0);
+        gtk_box_pack_start(GTK_BOX(hbox), spacer_new(16, -1), FALSE, FALSE, 0);
+        w = check_button_new("Learn words from entered text",
+                             &learn_words, FALSE);
+        gtk_box_pack_start(GTK_BOX(hbox), w, TRUE, TRUE, 0);
+        gtk_box_pack_start(GTK_BOX(vbox2), hbox, FALSE, FALSE, 0);
+        gtk_tooltips_set_tip(tooltips, w,
+                             "Remember the words you enter so that words "
+                             "missing from the dictionary are recognized "
+                             "too. Every word you enter, including "
+                             "passwords, is stored on disk in "
+                             "~/." PACKAGE "/wordfreq.learned, readable "
+                             "only by you.", NULL);
+
         /* Recognition -> Preprocessor */
         gtk_box_pack_start(GTK_BOX(vbox2), spacer_new(-1, 8), FALSE, FALSE, 0);
         w = label_new_markup("<b>Preprocessor</b>");
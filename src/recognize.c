@@ -33,6 +33,8 @@ int prep_examined;
 
 void engine_prep(void);
 
+static void sample_write(Sample *sample);
+
 /*
         Engines
 */
@@ -49,6 +51,9 @@ Engine engines[] = {
 #ifndef DISABLE_WORDFREQ
         /* Word frequency engine */
         { "Word context", engine_wordfreq, MAX_RANGE / 3, FALSE, -1, 0, 0 },
+
+        /* Character n-gram engine */
+        { "Character context", engine_ngram, MAX_RANGE / 6, FALSE, -1, 0, 0 },
 #endif
 };
 
@@ -118,7 +123,7 @@ int samples_loaded(void)
         Samples
 */
 
-int samples_max = 5, no_latin_alpha = FALSE;
+int samples_max = 5, no_latin_alpha = FALSE, compact_samples = FALSE;
 
 void clear_sample(Sample *sample)
 /* Free stroke data associated with a sample and reset its parameters */
@@ -351,18 +356,76 @@ void update_enabled_samples(void)
         }
 }
 
+static int sample_hash(const Sample *sample)
+/* Hash the point data of a sample so that journal records can tell apart
+   samples with the same character and usage counter */
+{
+        unsigned int hash = 2166136261u;
+        int i, j;
+
+        for (i = 0; i < sample->len; i++)
+                for (j = 0; j < sample->strokes[i]->len; j++) {
+                        hash = (hash ^ (unsigned char)
+                                sample->strokes[i]->points[j].x) * 16777619u;
+                        hash = (hash ^ (unsigned char)
+                                sample->strokes[i]->points[j].y) * 16777619u;
+                }
+        return hash & 0x7fffffff;
+}
+
+static void journal_sample_key(const char *cmd, const Sample *sample)
+/* Start a journal record that refers to a sample already in the set */
+{
+        profile_write(cmd);
+        profile_write_int(sample->ch, 0);
+        profile_write_int(sample->used, 0);
+        profile_write_int(sample_hash(sample), 0);
+}
+
 void promote_sample(Sample *sample)
 /* Update usage counter for a sample */
 {
+        if (journal_begin()) {
+                journal_sample_key("promote", sample);
+                profile_write_int(current, 0);
+                profile_write("\n");
+                journal_end();
+        }
         sample->used = current++;
 }
 
+static GHashTable *trained = NULL;
+
+static void trained_count(gunichar ch, int change)
+/* A sample was added to or removed from the set, update the count of the
+   character's samples if they have been counted */
+{
+        int count;
+
+        if (!trained || !ch)
+                return;
+        count = GPOINTER_TO_INT(g_hash_table_lookup(trained,
+                                                    GUINT_TO_POINTER(ch)));
+        count += change;
+        if (count > 0)
+                g_hash_table_insert(trained, GUINT_TO_POINTER(ch),
+                                    GINT_TO_POINTER(count));
+        else
+                g_hash_table_remove(trained, GUINT_TO_POINTER(ch));
+}
+
 void demote_sample(Sample *sample)
 /* Remove the sample from our set if we can */
 {
-        if (char_trained(sample->ch) > 1)
+        if (journal_begin()) {
+                journal_sample_key("demote", sample);
+                profile_write("\n");
+                journal_end();
+        }
+        if (char_trained(sample->ch) > 1) {
+                trained_count(sample->ch, -1);
                 clear_sample(sample);
-        else
+        } else
                 sample->used = 1;
 }
 
@@ -560,7 +623,7 @@ static void insert_sample(const Sample *new_sample, int force_overwrite)
 /* Insert a sample into the sample chain, possibly overwriting an older
    sample */
 {
-        int last_used, count = 0;
+        int i, last_used, count = 0;
         Sample *sample, *overwrite = NULL, *create = NULL;
 
         last_used = force_overwrite ? current + 1 : new_sample->used;
@@ -580,13 +643,22 @@ static void insert_sample(const Sample *new_sample, int force_overwrite)
         }
         if (overwrite && count >= samples_max) {
                 sample = overwrite;
+                trained_count(sample->ch, -1);
                 clear_sample(sample);
-        } else if (create)
+        } else if (create) {
                 sample = create;
-        else
+                trained_count(sample->ch, -1);
+        } else
                 sample = sample_new();
         *sample = *new_sample;
         process_sample(sample);
+        trained_count(sample->ch, 1);
+
+        /* Stored samples are not drawn on again */
+        for (i = 0; i < sample->len; i++) {
+                sample->strokes[i] = stroke_compact(sample->strokes[i]);
+                sample->roughs[i] = stroke_compact(sample->roughs[i]);
+        }
 }
 
 void train_sample(const Sample *sample, int trusted)
@@ -604,22 +676,37 @@ void train_sample(const Sample *sample, int trusted)
         copy_sample(&new_sample, sample);
         new_sample.used = trusted ? current++ : 1;
         new_sample.enabled = TRUE;
+        if (journal_begin()) {
+                sample_write(&new_sample);
+                journal_end();
+        }
         insert_sample(&new_sample, TRUE);
 }
 
 int char_trained(gunichar ch)
-/* Count the number of samples for this character */
+/* Count the number of samples for this character. The samples for every
+   character are counted in one pass the first time and the counts are kept
+   up to date as samples are added and removed. */
 {
-        Sample *sample;
-        int count = 0;
+        if (!trained) {
+                Sample *sample;
 
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
-                if (sample->ch != ch)
-                        continue;
-                count++;
+                trained = g_hash_table_new(g_direct_hash, g_direct_equal);
+                sampleiter_reset();
+                while ((sample = sampleiter_next())) {
+                        int count;
+
+                        if (!sample->ch)
+                                continue;
+                        count = GPOINTER_TO_INT(g_hash_table_lookup(trained,
+                                                GUINT_TO_POINTER(sample->ch)));
+                        g_hash_table_insert(trained,
+                                            GUINT_TO_POINTER(sample->ch),
+                                            GINT_TO_POINTER(count + 1));
+                }
         }
-        return count;
+        return GPOINTER_TO_INT(g_hash_table_lookup(trained,
+                                                   GUINT_TO_POINTER(ch)));
 }
 
 void untrain_char(gunichar ch)
@@ -627,10 +714,18 @@ void untrain_char(gunichar ch)
 {
         Sample *sample;
 
+        if (journal_begin()) {
+                profile_write("untrain");
+                profile_write_int(ch, 0);
+                profile_write("\n");
+                journal_end();
+        }
         sampleiter_reset();
         while ((sample = sampleiter_next()))
                 if (sample->ch == ch)
                         clear_sample(sample);
+        if (trained)
+                g_hash_table_remove(trained, GUINT_TO_POINTER(ch));
 }
 
 /*
@@ -653,77 +748,266 @@ void recognize_sync(void)
         profile_write("\n");
 }
 
-void sample_read(void)
-/* Read a sample from the profile */
+/* Packed samples store each stroke as a single token. The first point is
+   relative to the origin and each following point is relative to the one
+   before it. Every coordinate is zig-zag encoded so that small negative
+   values stay small and then written five bits at a time, low bits first,
+   as base64 digits with the sixth bit set on all but the last digit. Points
+   rarely move more than 15 units so most take two characters. */
+
+#define PACK_MORE 0x20
+#define PACK_BITS 0x1f
+
+static const char pack_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                  "abcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char *pack_value(char *out, int value)
+/* Append a zig-zag varint to the output and return the new end */
+{
+        unsigned int n;
+
+        n = value < 0 ? ((unsigned int)-value << 1) - 1 :
+                        (unsigned int)value << 1;
+        while (n > PACK_BITS) {
+                *out++ = pack_digits[(n & PACK_BITS) | PACK_MORE];
+                n >>= 5;
+        }
+        *out++ = pack_digits[n];
+        return out;
+}
+
+static const char *unpack_value(const char *str, int *value)
+/* Decode a zig-zag varint. Returns a pointer to the next value or NULL if the
+   string is malformed. */
+{
+        unsigned int n = 0;
+        int shift, digit;
+
+        for (shift = 0; shift < 15; shift += 5) {
+                if (*str >= 'A' && *str <= 'Z')
+                        digit = *str - 'A';
+                else if (*str >= 'a' && *str <= 'z')
+                        digit = *str - 'a' + 26;
+                else if (*str >= '0' && *str <= '9')
+                        digit = *str - '0' + 52;
+                else if (*str == '+')
+                        digit = 62;
+                else if (*str == '/')
+                        digit = 63;
+                else
+                        return NULL;
+                str++;
+                n |= (digit & PACK_BITS) << shift;
+                if (!(digit & PACK_MORE)) {
+                        *value = n & 1 ? -(int)(n >> 1) - 1 : (int)(n >> 1);
+                        return str;
+                }
+        }
+        return NULL;
+}
+
+static Stroke *stroke_unpack(const char *str)
+/* Decode a packed stroke token. Returns NULL if the token is invalid. */
+{
+        Stroke *stroke;
+        int x = 0, y = 0;
+
+        stroke = stroke_new(0);
+        while (str && *str) {
+                int dx, dy;
+
+                if (stroke->len >= POINTS_MAX ||
+                    !(str = unpack_value(str, &dx)) ||
+                    !(str = unpack_value(str, &dy)))
+                        break;
+                x += dx;
+                y += dy;
+                if (x < -128 || x > 127 || y < -128 || y > 127) {
+                        str = NULL;
+                        break;
+                }
+                draw_stroke(&stroke, x, y);
+        }
+        if (!str || *str || stroke->len < 1) {
+                stroke_free(stroke);
+                return NULL;
+        }
+        return stroke;
+}
+
+static int sample_parse_packed(Sample *sample)
+/* Read packed stroke tokens for a sample */
+{
+        for (;;) {
+                const char *str;
+
+                str = profile_read();
+                if (!str[0])
+                        break;
+                if (sample->len >= STROKES_MAX) {
+                        g_warning("Sample on line %d ('%C') is oversize",
+                                  profile_line, sample->ch);
+                        clear_sample(sample);
+                        return FALSE;
+                }
+                sample->strokes[sample->len] = stroke_unpack(str);
+                if (!sample->strokes[sample->len]) {
+                        g_warning("Sample on line %d ('%C') has invalid "
+                                  "stroke %d", profile_line, sample->ch,
+                                  sample->len + 1);
+                        clear_sample(sample);
+                        return FALSE;
+                }
+                sample->len++;
+        }
+        if (!sample->len) {
+                g_warning("Sample on line %d ('%C') with no point data",
+                          profile_line, sample->ch);
+                return FALSE;
+        }
+        return TRUE;
+}
+
+static int sample_parse(Sample *sample, int packed)
+/* Read sample data from the profile. Returns TRUE if a valid sample was read,
+   the caller is then responsible for inserting or clearing it. */
 {
-        Sample sample;
         Stroke *stroke;
 
-        memset(&sample, 0, sizeof (sample));
-        sample.ch = atoi(profile_read());
-        if (!sample.ch) {
+        memset(sample, 0, sizeof (*sample));
+        sample->ch = atoi(profile_read());
+        if (!sample->ch) {
                 g_warning("Sample on line %d has NULL symbol", profile_line);
-                return;
+                return FALSE;
         }
-        sample.used = atoi(profile_read());
-        stroke = sample.strokes[0];
+        sample->used = atoi(profile_read());
+        if (packed)
+                return sample_parse_packed(sample);
+        stroke = sample->strokes[0];
         for (;;) {
                 const char *str;
                 int x, y;
 
                 str = profile_read();
                 if (!str[0]) {
-                        if (!sample.strokes[0]) {
+                        if (!sample->strokes[0]) {
                                 g_warning("Sample on line %d ('%C') with no "
                                           "point data", profile_line,
-                                          sample.ch);
-                                break;
+                                          sample->ch);
+                                return FALSE;
                         }
-                        insert_sample(&sample, FALSE);
-                        break;
+                        return TRUE;
                 }
                 if (str[0] == ';') {
-                        stroke = sample.strokes[sample.len];
+                        stroke = NULL;
                         continue;
                 }
-                if (sample.len >= STROKES_MAX) {
+                if (sample->len >= STROKES_MAX && !stroke) {
                         g_warning("Sample on line %d ('%C') is oversize",
-                                  profile_line, sample.ch);
-                        clear_sample(&sample);
-                        break;
+                                  profile_line, sample->ch);
+                        clear_sample(sample);
+                        return FALSE;
                 }
                 if (!stroke) {
                         stroke = stroke_new(0);
-                        sample.strokes[sample.len++] = stroke;
+                        sample->strokes[sample->len++] = stroke;
                 }
                 if (stroke->len >= POINTS_MAX) {
                         g_warning("Symbol '%C' stroke %d is oversize",
-                                  sample.ch, sample.len);
-                        clear_sample(&sample);
-                        break;
+                                  sample->ch, sample->len);
+                        clear_sample(sample);
+                        return FALSE;
                 }
                 x = atoi(str);
                 y = atoi(profile_read());
+
+                /* Growing the stroke can move it */
                 draw_stroke(&stroke, x, y);
+                sample->strokes[sample->len - 1] = stroke;
         }
 }
 
+void sample_read(void)
+/* Read a sample from the profile */
+{
+        Sample sample;
+
+        if (sample_parse(&sample, FALSE))
+                insert_sample(&sample, FALSE);
+}
+
+void sample_packed_read(void)
+/* Read a packed sample from the profile */
+{
+        Sample sample;
+
+        if (sample_parse(&sample, TRUE))
+                insert_sample(&sample, FALSE);
+}
+
 static void sample_write(Sample *sample)
 /* Write a sample link to the profile */
 {
         int k, l;
 
-        profile_write(va("sample %5d %5d", sample->ch, sample->used));
+        if (compact_samples) {
+                /* Deltas fit in two digits each */
+                char buf[POINTS_MAX * 4 + 2];
+
+                profile_write("sample_packed");
+                profile_write_int(sample->ch, 0);
+                profile_write_int(sample->used, 0);
+                for (k = 0; k < sample->len; k++) {
+                        Stroke *stroke = sample->strokes[k];
+                        char *out = buf;
+                        int x = 0, y = 0;
+
+                        *out++ = ' ';
+                        for (l = 0; l < stroke->len; l++) {
+                                out = pack_value(out, stroke->points[l].x - x);
+                                out = pack_value(out, stroke->points[l].y - y);
+                                x = stroke->points[l].x;
+                                y = stroke->points[l].y;
+                        }
+                        *out = 0;
+                        profile_write(buf);
+                }
+                profile_write("\n");
+                return;
+        }
+        profile_write("sample");
+        profile_write_int(sample->ch, 5);
+        profile_write_int(sample->used, 5);
         for (k = 0; k < sample->len; k++) {
-                for (l = 0; l < sample->strokes[k]->len; l++)
-                        profile_write(va(" %4d %4d",
-                                         sample->strokes[k]->points[l].x,
-                                         sample->strokes[k]->points[l].y));
+                for (l = 0; l < sample->strokes[k]->len; l++) {
+                        profile_write_int(sample->strokes[k]->points[l].x, 4);
+                        profile_write_int(sample->strokes[k]->points[l].y, 4);
+                }
                 profile_write("    ;");
         }
         profile_write("\n");
 }
 
+int samples_point_bytes(void)
+/* Bytes the strokes of all samples need for their points, without the
+   rounding up to a stroke size class */
+{
+        Sample *sample;
+        int i, bytes = 0;
+
+        sampleiter_reset();
+        while ((sample = sampleiter_next()))
+                for (i = 0; i < sample->len; i++) {
+                        if (sample->strokes[i])
+                                bytes += sizeof (Stroke) + sizeof (Point) *
+                                         sample->strokes[i]->len;
+                        if (sample->roughs[i])
+                                bytes += sizeof (Stroke) + sizeof (Point) *
+                                         sample->roughs[i]->len;
+                }
+        return bytes;
+}
+
 void samples_write(void)
 /* Write all of the samples to the profile */
 {
@@ -734,3 +1018,84 @@ void samples_write(void)
                 if (sample->ch && sample->used)
                         sample_write(sample);
 }
+
+/*
+        Training journal replay
+*/
+
+static Sample *journal_find_sample(void)
+/* Read a sample reference from a journal record and find the sample */
+{
+        Sample *sample;
+        gunichar ch;
+        int used, hash;
+
+        ch = atoi(profile_read());
+        used = atoi(profile_read());
+        hash = atoi(profile_read());
+        sampleiter_reset();
+        while ((sample = sampleiter_next()))
+                if (sample->ch == ch && sample->used == used &&
+                    sample_hash(sample) == hash)
+                        return sample;
+        g_warning("Journal line %d refers to a missing sample for '%C'",
+                  profile_line, ch);
+        return NULL;
+}
+
+static void journal_replay_sample(int packed)
+/* Replay a trained sample */
+{
+        Sample sample;
+
+        if (!sample_parse(&sample, packed))
+                return;
+        if (sample.used >= current)
+                current = sample.used + 1;
+        insert_sample(&sample, TRUE);
+}
+
+void journal_sample_read(void)
+{
+        journal_replay_sample(FALSE);
+}
+
+void journal_sample_packed_read(void)
+{
+        journal_replay_sample(TRUE);
+}
+
+void journal_untrain_read(void)
+/* Replay untraining a character */
+{
+        gunichar ch;
+
+        ch = atoi(profile_read());
+        if (ch)
+                untrain_char(ch);
+}
+
+void journal_promote_read(void)
+/* Replay a sample promotion */
+{
+        Sample *sample;
+        int used;
+
+        sample = journal_find_sample();
+        used = atoi(profile_read());
+        if (!sample || used < 1)
+                return;
+        sample->used = used;
+        if (used >= current)
+                current = used + 1;
+}
+
+void journal_demote_read(void)
+/* Replay a sample demotion */
+{
+        Sample *sample;
+
+        sample = journal_find_sample();
+        if (sample)
+                demote_sample(sample);
+}
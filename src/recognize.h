@@ -56,6 +56,7 @@ typedef struct {
 Stroke *stroke_new(int size);
 Stroke *stroke_clone(const Stroke *src, int reverse);
 void stroke_free(Stroke *stroke);
+Stroke *stroke_compact(Stroke *stroke);
 void clear_stroke(Stroke *stroke);
 
 /* Stroke manipulation */
@@ -63,6 +64,7 @@ void process_stroke(Stroke *stroke);
 void draw_stroke(Stroke **stroke, int x, int y);
 void smooth_stroke(Stroke *s);
 void simplify_stroke(Stroke *s);
+void stream_stroke(Stroke **stroke, int x, int y);
 Stroke *sample_stroke(Stroke *out, Stroke *in, int points, int size);
 void sample_strokes(Stroke *a, Stroke *b, Stroke **as, Stroke **bs);
 void glue_stroke(Stroke **a, const Stroke *b, int reverse);
@@ -93,6 +95,7 @@ enum {
         ENGINE_AVGANGLE,
 #ifndef DISABLE_WORDFREQ
         ENGINE_WORDFREQ,
+        ENGINE_NGRAM,
 #endif
         ENGINES
 };
@@ -105,16 +108,26 @@ typedef struct {
 
 typedef struct Cell Cell;
 
+/* Longest word completion including the terminating zero */
+#define COMPLETION_LEN 32
+
 /* Generalized measure function */
 typedef float (*MeasureFunc)(Stroke *a, int i, Stroke *b, int j, void *extra);
 
 extern int ignore_stroke_order, ignore_stroke_dir, ignore_stroke_num,
-           elasticity, no_latin_alpha, wordfreq_enable;
+           elasticity, no_latin_alpha, wordfreq_enable, learn_words;
 extern Engine engines[ENGINES];
 
 void engine_average(void);
 void engine_wordfreq(void);
+void engine_ngram(void);
 void load_wordfreq(void);
+int wordfreq_child(int node, gunichar ch);
+int wordfreq_ends(int node);
+int wordfreq_learned(const gunichar *string, int len);
+void wordfreq_learn(const gunichar *text);
+int wordfreq_complete(const gunichar *pre, int pre_len,
+                      gunichar (*words)[COMPLETION_LEN], int max);
 float measure_distance(const Stroke *a, int i, const Stroke *b, int j,
                        const Vec2 *offset);
 float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
@@ -158,7 +171,7 @@ typedef struct {
 } Sample;
 
 extern Sample *input;
-extern int num_disqualified, training_block, samples_max;
+extern int num_disqualified, training_block, samples_max, compact_samples;
 
 /* Sample list iteration */
 void sampleiter_reset(void);
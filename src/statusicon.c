@@ -34,6 +34,12 @@ extern GtkWidget *window;
 
 void window_toggle(void);
 
+/* wordfreq.c */
+int wordfreq_dictionaries(void);
+const char *wordfreq_dictionary_name(int index);
+int wordfreq_dictionary(void);
+void wordfreq_select(int index);
+
 /*
         Status icon menu
 */
@@ -71,10 +77,18 @@ static void position_menu_libegg(GtkMenu *menu, int *x, int *y,
 #define POSITION_MENU_FUNC gtk_status_icon_position_menu
 #endif
 
+static void status_menu_dictionary(GtkWidget *widget, gpointer index)
+{
+        if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget)))
+                wordfreq_select(GPOINTER_TO_INT(index));
+}
+
 static void status_menu_popup(GObject *status, guint button,
                               guint activate_time)
 {
         GtkWidget *widget, *image;
+        GSList *group = NULL;
+        int i, row;
 
         if (status_menu)
                 gtk_widget_destroy(status_menu);
@@ -98,16 +112,40 @@ static void status_menu_popup(GObject *status, guint button,
         g_signal_connect(G_OBJECT(widget), "activate",
                          G_CALLBACK(options_dialog_open), 0);
         gtk_menu_attach(GTK_MENU(status_menu), widget, 0, 1, 1, 2);
+        row = 2;
+
+        /* Menu -> Dictionaries */
+        if (wordfreq_dictionaries() > 1) {
+                widget = gtk_separator_menu_item_new();
+                gtk_menu_attach(GTK_MENU(status_menu), widget,
+                                0, 1, row, row + 1);
+                row++;
+                for (i = 0; i < wordfreq_dictionaries(); i++, row++) {
+                        widget = gtk_radio_menu_item_new_with_label(group,
+                                                wordfreq_dictionary_name(i));
+                        group = gtk_radio_menu_item_get_group(
+                                                GTK_RADIO_MENU_ITEM(widget));
+                        if (i == wordfreq_dictionary())
+                                gtk_check_menu_item_set_active(
+                                        GTK_CHECK_MENU_ITEM(widget), TRUE);
+                        g_signal_connect(G_OBJECT(widget), "toggled",
+                                         G_CALLBACK(status_menu_dictionary),
+                                         GINT_TO_POINTER(i));
+                        gtk_menu_attach(GTK_MENU(status_menu), widget,
+                                        0, 1, row, row + 1);
+                }
+        }
 
         /* Menu -> Separator */
         widget = gtk_separator_menu_item_new();
-        gtk_menu_attach(GTK_MENU(status_menu), widget, 0, 1, 2, 3);
+        gtk_menu_attach(GTK_MENU(status_menu), widget, 0, 1, row, row + 1);
+        row++;
 
         /* Menu -> Close */
         widget = gtk_image_menu_item_new_from_stock(GTK_STOCK_QUIT, NULL);
         g_signal_connect(G_OBJECT(widget), "activate",
                          G_CALLBACK(gtk_main_quit), NULL);
-        gtk_menu_attach(GTK_MENU(status_menu), widget, 0, 1, 3, 4);
+        gtk_menu_attach(GTK_MENU(status_menu), widget, 0, 1, row, row + 1);
 
         /* Popup the menu */
         gtk_widget_show_all(status_menu);
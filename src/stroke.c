@@ -35,14 +35,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
    not exceeded, will cause the point to be culled during simplification */
 #define SIMPLIFY_THRESHOLD 0.5
 
-/* Granularity of stroke point array in points */
+/* Initial size of the stroke point array in points, it doubles from there */
 #define POINTS_GRAN 64
 
 /* Size of a stroke structure */
 #define STROKE_SIZE(size) (sizeof (Stroke) + (size) * sizeof (Point))
 
+/* Bytes of memory allocated at a time for a stroke size class */
+#define SLAB_SIZE 16384
+
 void process_stroke(Stroke *stroke)
-/* Generate cached parameters of a stroke */
+/* Generate cached parameters of a stroke. Strokes built with draw_stroke()
+   keep these up to date as points are added. */
 {
         int i;
         float distance;
@@ -50,6 +54,7 @@ void process_stroke(Stroke *stroke)
         if (stroke->processed)
                 return;
         stroke->processed = TRUE;
+        vec2_set(&stroke->center, 0., 0.);
 
         /* Dot strokes */
         if (stroke->len == 1) {
@@ -109,6 +114,152 @@ void clear_stroke(Stroke *stroke)
         stroke->size = size;
 }
 
+/*
+        Stroke allocation
+*/
+
+/* Stroke sizes in points that are allocated from slabs. Trained strokes are
+   never drawn on again, so they are moved to the smallest class that holds
+   them. A stroke may take up to one and a half times the room its points
+   need, in exchange for allocations that do not fragment the heap. Strokes
+   larger than the largest class come from the heap. */
+static const int stroke_classes[] = {
+        4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, POINTS_MAX,
+};
+
+#define STROKE_CLASSES ((int)(sizeof (stroke_classes) / \
+                              sizeof (*stroke_classes)))
+
+/* Freed strokes are linked through their own memory */
+typedef struct StrokeLink {
+        struct StrokeLink *next;
+} StrokeLink;
+
+static StrokeLink *stroke_free_lists[STROKE_CLASSES];
+static int stroke_live = 0, stroke_reserved = 0;
+
+static int stroke_class(int size)
+/* Find the smallest size class that fits, -1 if none */
+{
+        int i;
+
+        for (i = 0; i < STROKE_CLASSES; i++)
+                if (stroke_classes[i] >= size)
+                        return i;
+        return -1;
+}
+
+static int stroke_bytes(int size)
+/* Bytes taken by a stroke of a size class, rounded up to keep the strokes
+   in a slab aligned */
+{
+        int bytes;
+
+        bytes = STROKE_SIZE(size);
+        return (bytes + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+}
+
+static void slab_new(int class)
+/* Allocate a slab of strokes and put them on the free list of their class */
+{
+        StrokeLink *link;
+        char *slab;
+        int i, bytes, len;
+
+        bytes = stroke_bytes(stroke_classes[class]);
+        len = SLAB_SIZE / bytes;
+        if (len < 1)
+                len = 1;
+        slab = g_malloc(len * bytes);
+        stroke_reserved += len * bytes;
+        for (i = 0; i < len; i++) {
+                link = (StrokeLink *)(slab + i * bytes);
+                link->next = stroke_free_lists[class];
+                stroke_free_lists[class] = link;
+        }
+}
+
+static Stroke *stroke_alloc(int size)
+/* Allocate an uninitialized stroke with room for at least size points */
+{
+        Stroke *stroke;
+        int class;
+
+        class = stroke_class(size);
+        if (class < 0) {
+                stroke = g_malloc(STROKE_SIZE(size));
+                stroke->size = size;
+                stroke_live += STROKE_SIZE(size);
+                stroke_reserved += STROKE_SIZE(size);
+                return stroke;
+        }
+        if (!stroke_free_lists[class])
+                slab_new(class);
+        stroke = (Stroke *)stroke_free_lists[class];
+        stroke_free_lists[class] = stroke_free_lists[class]->next;
+        stroke->size = stroke_classes[class];
+        stroke_live += stroke_bytes(stroke->size);
+        return stroke;
+}
+
+void stroke_free(Stroke *stroke)
+{
+        StrokeLink *link;
+        int class;
+
+        if (!stroke)
+                return;
+        class = stroke_class(stroke->size);
+        if (class < 0 || stroke_classes[class] != stroke->size) {
+                stroke_live -= STROKE_SIZE(stroke->size);
+                stroke_reserved -= STROKE_SIZE(stroke->size);
+                g_free(stroke);
+                return;
+        }
+        stroke_live -= stroke_bytes(stroke->size);
+        link = (StrokeLink *)stroke;
+        link->next = stroke_free_lists[class];
+        stroke_free_lists[class] = link;
+}
+
+static Stroke *stroke_resize(Stroke *stroke, int size)
+/* Move a stroke to a size class that fits size points */
+{
+        Stroke *new_stroke;
+
+        if (size <= stroke->size)
+                return stroke;
+        new_stroke = stroke_alloc(size);
+        size = new_stroke->size;
+        memcpy(new_stroke, stroke, STROKE_SIZE(stroke->len));
+        new_stroke->size = size;
+        stroke_free(stroke);
+        return new_stroke;
+}
+
+Stroke *stroke_compact(Stroke *stroke)
+/* Move a stroke that will not grow any more to the smallest size class that
+   holds its points */
+{
+        Stroke *new_stroke;
+
+        if (!stroke || stroke_class(stroke->len) < 0 ||
+            stroke_classes[stroke_class(stroke->len)] >= stroke->size)
+                return stroke;
+        new_stroke = stroke_clone(stroke, FALSE);
+        stroke_free(stroke);
+        return new_stroke;
+}
+
+void stroke_heap(int *live, int *reserved)
+/* Bytes taken by the size classes of live strokes and bytes allocated for
+   all strokes. The points themselves may need less, see
+   samples_point_bytes(). */
+{
+        *live = stroke_live;
+        *reserved = stroke_reserved;
+}
+
 Stroke *stroke_new(int size)
 /* Allocate memory for a new stroke */
 {
@@ -116,8 +267,7 @@ Stroke *stroke_new(int size)
 
         if (size < POINTS_GRAN)
                 size = POINTS_GRAN;
-        stroke = g_malloc(STROKE_SIZE(size));
-        stroke->size = size;
+        stroke = stroke_alloc(size);
         clear_stroke(stroke);
         return stroke;
 }
@@ -137,26 +287,25 @@ static void reverse_copy_points(Point *dest, const Point *src, int len)
 }
 
 Stroke *stroke_clone(const Stroke *src, int reverse)
+/* Copy a stroke into the smallest size class that holds its points */
 {
         Stroke *stroke;
+        int size;
 
         if (!src)
                 return NULL;
-        stroke = stroke_new(src->size);
+        stroke = stroke_alloc(src->len);
+        size = stroke->size;
         if (!reverse)
-                memcpy(stroke, src, STROKE_SIZE(src->size));
+                memcpy(stroke, src, STROKE_SIZE(src->len));
         else {
                 memcpy(stroke, src, sizeof (Stroke));
                 reverse_copy_points(stroke->points, src->points, src->len);
         }
+        stroke->size = size;
         return stroke;
 }
 
-void stroke_free(Stroke *stroke)
-{
-        g_free(stroke);
-}
-
 void glue_stroke(Stroke **pa, const Stroke *b, int reverse)
 /* Glue B onto the end of A preserving processed properties */
 {
@@ -176,10 +325,7 @@ void glue_stroke(Stroke **pa, const Stroke *b, int reverse)
         }
 
         /* Allocate memory */
-        if (a->size < a->len + b->len) {
-                a->size = a->len + b->len;
-                a = g_realloc(a, STROKE_SIZE(a->size));
-        }
+        a = stroke_resize(a, a->len + b->len);
 
         /* Gluing two strokes creates a new segment between them */
         start = reverse ? b->points[b->len - 1] : b->points[0];
@@ -223,6 +369,84 @@ void glue_stroke(Stroke **pa, const Stroke *b, int reverse)
         *pa = a;
 }
 
+static void add_point_stats(Stroke *s)
+/* Update the cached parameters of a stroke with its last point */
+{
+        Point *a, *b;
+        Vec2 v, mid;
+        float weight;
+
+        b = s->points + s->len - 1;
+        if (s->len == 1) {
+                s->min_x = s->max_x = b->x;
+                s->min_y = s->max_y = b->y;
+                vec2_set(&s->center, b->x, b->y);
+                s->distance = 0.f;
+                s->spread = 0;
+                s->processed = TRUE;
+                return;
+        }
+
+        /* Angle, the last point takes the angle of the last segment */
+        a = b - 1;
+        vec2_set(&v, b->x - a->x, b->y - a->y);
+        a->angle = b->angle = vec2_angle(&v);
+
+        /* Spread */
+        if (b->x < s->min_x)
+                s->min_x = b->x;
+        if (b->y < s->min_y)
+                s->min_y = b->y;
+        if (b->x > s->max_x)
+                s->max_x = b->x;
+        if (b->y > s->max_y)
+                s->max_y = b->y;
+        s->spread = s->max_x - s->min_x;
+        if (s->max_y - s->min_y > s->spread)
+                s->spread = s->max_y - s->min_y;
+
+        /* Segment contribution to center */
+        weight = vec2_mag(&v);
+        if (weight <= 0.f)
+                return;
+        vec2_set(&mid, (a->x + b->x) / 2.f, (a->y + b->y) / 2.f);
+        vec2_scale(&s->center, &s->center, s->distance);
+        vec2_scale(&mid, &mid, weight);
+        vec2_sum(&s->center, &s->center, &mid);
+        s->distance += weight;
+        vec2_scale(&s->center, &s->center, 1.f / s->distance);
+}
+
+static void remove_point_stats(Stroke *s)
+/* Take the last point's segment out of the cached parameters before the
+   point is removed. The spread cannot shrink, but the point is only ever
+   replaced by one further along the same line. */
+{
+        Point *a, *b;
+        Vec2 v, mid;
+        float weight;
+
+        if (s->len < 2)
+                return;
+        b = s->points + s->len - 1;
+        a = b - 1;
+        vec2_set(&v, b->x - a->x, b->y - a->y);
+        weight = vec2_mag(&v);
+        if (weight <= 0.f)
+                return;
+        if (s->distance - weight <= 0.f) {
+                vec2_set(&s->center, s->points[0].x, s->points[0].y);
+                s->distance = 0.f;
+                return;
+        }
+        vec2_set(&mid, (a->x + b->x) / 2.f, (a->y + b->y) / 2.f);
+        vec2_scale(&s->center, &s->center, s->distance);
+        vec2_scale(&mid, &mid, weight);
+        vec2_sub(&s->center, &s->center, &mid);
+        s->distance -= weight;
+        vec2_scale(&s->center, &s->center, 1.f / s->distance);
+}
+
 void draw_stroke(Stroke **ps, int x, int y)
 /* Add a point in scaled coordinates to a stroke */
 {
@@ -230,14 +454,21 @@ void draw_stroke(Stroke **ps, int x, int y)
         if (!(*ps))
                 *ps = stroke_new(0);
 
-        /* If we run out of room, resample the stroke to fit */
+        /* If we run out of room, simplify the stroke and only resample it
+           if that did not make enough room */
         if ((*ps)->len >= POINTS_MAX) {
-                Stroke *new_stroke;
-
-                new_stroke = sample_stroke(NULL, *ps, POINTS_MAX - POINTS_GRAN,
-                                           POINTS_MAX);
-                stroke_free(*ps);
-                *ps = new_stroke;
+                simplify_stroke(*ps);
+                if ((*ps)->len >= POINTS_MAX - POINTS_GRAN) {
+                        Stroke *new_stroke;
+
+                        new_stroke = sample_stroke(NULL, *ps,
+                                                   POINTS_MAX - POINTS_GRAN,
+                                                   POINTS_MAX);
+                        stroke_free(*ps);
+                        *ps = new_stroke;
+                }
+                (*ps)->processed = FALSE;
+                process_stroke(*ps);
         }
 
         /* Range limits */
@@ -251,13 +482,15 @@ void draw_stroke(Stroke **ps, int x, int y)
                 y = SCALE / 2 - 1;
 
         /* Do we need more memory? */
-        if ((*ps)->len >= (*ps)->size) {
-                (*ps)->size += POINTS_GRAN;
-                *ps = g_realloc(*ps, STROKE_SIZE((*ps)->size));
-        }
+        if ((*ps)->len >= (*ps)->size)
+                *ps = stroke_resize(*ps, (*ps)->size * 2 < POINTS_MAX ?
+                                         (*ps)->size * 2 : POINTS_MAX);
 
+        /* Strokes that were processed before are kept up to date */
         (*ps)->points[(*ps)->len].x = x;
         (*ps)->points[(*ps)->len++].y = y;
+        if ((*ps)->processed || (*ps)->len == 1)
+                add_point_stats(*ps);
 }
 
 void smooth_stroke(Stroke *s)
@@ -289,42 +522,74 @@ void smooth_stroke(Stroke *s)
                 last_y = s->points[i].y;
                 s->points[i].x = b.x + 0.5;
                 s->points[i].y = b.y + 0.5;
+                if (s->points[i].x != last_x || s->points[i].y != last_y)
+                        s->processed = FALSE;
         }
 }
 
+static int point_between(const Point *a, const Point *b, const Point *c)
+/* Returns TRUE if point B is within the simplification threshold of the line
+   from A to C and lies between them */
+{
+        Vec2 l, w;
+        double dist, mag, dot;
+
+        /* Vector l is a unit vector from point A to point C */
+        vec2_set(&l, a->x - c->x, a->y - c->y);
+        mag = vec2_norm(&l, &l);
+
+        /* Vector w is a vector from point A to point B */
+        vec2_set(&w, a->x - b->x, a->y - b->y);
+
+        /* Do not touch mid points that are not in between their neighbors */
+        dot = vec2_dot(&l, &w);
+        if (dot < 0. || dot > mag)
+                return FALSE;
+
+        /* Points that are less than some threshold away from the line can
+           be removed */
+        dist = vec2_cross(&w, &l);
+        return dist < SIMPLIFY_THRESHOLD && dist > -SIMPLIFY_THRESHOLD;
+}
+
 void simplify_stroke(Stroke *s)
-/* Remove excess points between neighbors */
+/* Remove excess points between neighbors. Points are compared against the
+   last point that was kept and packed down in a single pass. */
+{
+        int i, j;
+
+        if (s->len < 3)
+                return;
+        for (i = 1, j = 1; i < s->len - 1; i++)
+                if (!point_between(s->points + j - 1, s->points + i,
+                                   s->points + i + 1))
+                        s->points[j++] = s->points[i];
+        s->points[j++] = s->points[s->len - 1];
+        if (j < s->len)
+                s->processed = FALSE;
+        s->len = j;
+}
+
+void stream_stroke(Stroke **ps, int x, int y)
+/* Add a point to a stroke as it is being drawn. If the last point lies on the
+   line to the new point it is replaced, so a stroke only grows where it
+   bends. */
 {
-	int i;
-
-	for (i = 1; i < s->len - 1; i++) {
-	        Vec2 l, w;
-		double dist, mag, dot;
-
-                /* Vector l is a unit vector from point i - 1 to point i + 1 */
-		vec2_set(&l, s->points[i - 1].x - s->points[i + 1].x,
-		         s->points[i - 1].y - s->points[i + 1].y);
-		mag = vec2_norm(&l, &l);
-
-		/* Vector w is a vector from point i - 1 to point i */
-		vec2_set(&w, s->points[i - 1].x - s->points[i].x,
-		         s->points[i - 1].y - s->points[i].y);
-
-		/* Do not touch mid points that are not in between their
-		   neighbors */
-		dot = vec2_dot(&l, &w);
-		if (dot < 0. || dot > mag)
-		        continue;
-
-		/* Remove any points that are less than some threshold away
-		   from their neighbor points */
-		dist = vec2_cross(&w, &l);
-		if (dist < SIMPLIFY_THRESHOLD && dist > -SIMPLIFY_THRESHOLD) {
-			memmove(s->points + i, s->points + i + 1,
-			        (--s->len - i) * sizeof (*s->points));
-			i--;
-		}
-	}
+        Point point;
+        Stroke *s;
+
+        s = *ps;
+        if (s && s->len >= 2) {
+                point.x = CLAMP(x, -SCALE / 2 + 1, SCALE / 2 - 1);
+                point.y = CLAMP(y, -SCALE / 2 + 1, SCALE / 2 - 1);
+                if (point_between(s->points + s->len - 2,
+                                  s->points + s->len - 1, &point)) {
+                        if (s->processed)
+                                remove_point_stats(s);
+                        s->len--;
+                }
+        }
+        draw_stroke(ps, x, y);
 }
 
 void dump_stroke(Stroke *stroke)
@@ -371,11 +636,13 @@ Stroke *sample_stroke(Stroke *out, Stroke *in, int points, int size)
         if (points < 1)
                 points = 1;
 
-        /* Allocate memory and copy cached data */
+        /* Allocate memory and copy cached data. The size of a stroke we did
+           not allocate belongs to its allocator, so only fill what fits. */
         if (!out)
-                out = g_malloc(STROKE_SIZE(size));
-        out->size = size;
-        len = out->size < points ? out->size - 1 : points - 1;
+                out = stroke_alloc(size);
+        else if (size > out->size)
+                size = out->size;
+        len = size < points ? size - 1 : points - 1;
         out->len = len + 1;
         out->spread = in->spread;
         out->center = in->center;
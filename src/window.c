@@ -60,8 +60,6 @@ int status_icon_embedded(void);
 /* main.c */
 extern int keyboard_only;
 
-void save_profile(void);
-
 /* keywidget.c */
 void key_widget_resize(KeyWidget *key_widget);
 
@@ -374,9 +372,10 @@ void train_button_toggled(void)
                 gtk_widget_show(insert_button);
                 gtk_widget_show(buffer_button);
 
-                /* Take the opportunity to save training data.
-                   TODO: Only save if there is new training data. */
-                save_profile();
+                /* Training data is already in the journal, make sure it is on
+                   disk. Without a journal, save the whole profile. */
+                if (!journal_flush())
+                        save_profile();
         }
 }
 
@@ -549,7 +548,8 @@ static void button_set_image_xpm(GtkWidget *button, char **xpm)
         gtk_button_set_image(GTK_BUTTON(button), image);
 }
 
-static void insert_button_clicked(void)
+void window_insert(void)
+/* Insert the text in the cells */
 {
         if (cell_widget_insert()) {
                 history_valid = TRUE;
@@ -722,7 +722,7 @@ void window_create(void)
         gtk_button_set_relief(GTK_BUTTON(insert_button), GTK_RELIEF_NONE);
         gtk_box_pack_start(GTK_BOX(bottom_box), insert_button, FALSE, FALSE, 0);
         g_signal_connect(G_OBJECT(insert_button), "clicked",
-                         G_CALLBACK(insert_button_clicked), 0);
+                         G_CALLBACK(window_insert), 0);
         gtk_tooltips_set_tip(tooltips, insert_button,
                              "Insert input or press Enter key", NULL);
 
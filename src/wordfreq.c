@@ -25,9 +25,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "recognize.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 /* cellwidget.c */
-const char *cell_widget_word(void);
+const gunichar *cell_widget_word(void);
 
 /*
         Word frequency engine
@@ -35,167 +40,1433 @@ const char *cell_widget_word(void);
 
 #ifndef DISABLE_WORDFREQ
 
-/* TODO needs to be internationalized (wide char)
-   TODO user-made words list
-   TODO choose a list via GUI
+/* TODO choose a list via GUI
    FIXME the frequency list contains "n't" etc as separate endings, this
          needs to be taken into consideration */
 
-/* The number of word frequency entries to load */
-#define WORDFREQS 15000
+/* Longest word prefix that is looked up, cell_widget_word() returns less */
+#define WORD_MAX 64
+
+/* Word frequency files are named "wordfreq" for the default dictionary and
+   "wordfreq-<name>" for the others. Each is compiled into an image named
+   after it with WORDFREQ_IMAGE appended that is rebuilt whenever the file
+   changes. An image installed next to a system file is used as is. Names
+   containing WORDFREQ_IMAGE are never dictionaries, this also skips the
+   temporary files left by an interrupted image write. */
+#define WORDFREQ_FILE "wordfreq"
+#define WORDFREQ_IMAGE ".bin"
+#define WORDFREQ_MAGIC 0x46575743
+#define WORDFREQ_VERSION 4
 
 typedef struct {
-        char string[24];
-        int count;
+        const gunichar *string;
+        int count, freq;
 } WordFreq;
 
-int wordfreq_enable = TRUE;
+/* Candidate next characters and their scores */
+typedef struct {
+        gunichar ch;
+        int score;
+} WordScore;
+
+/* The words are indexed by a trie of lower-case characters. The children of
+   every node are stored together, sorted by character, and each node has the
+   total count of all the words that pass through it. For completion, each
+   node also has the rank of the word that ends at it, zero if none, and the
+   best rank of any word under it. The node array is written out as is after
+   the image header and used in place from the mapped file. */
+typedef struct {
+        guint32 ch, children, children_len, count, end, best;
+} WordNode;
 
-static WordFreq wordfreqs[WORDFREQS + 1];
-static int wordfreqs_len, wordfreqs_count;
+/* Completions are ranked by log frequency in steps this fine, so that words
+   with close but different frequencies are not tied */
+#define RANK_STEPS 64
 
-void load_wordfreq(void)
-/* Read in the word frequency file. The file format is: word\tcount\n */
+/* Character n-grams are kept in an open-addressed hash table that is at most
+   half full. Each entry has the quantised log probability of character z
+   following characters x and y in the dictionary words, weighted by word
+   frequency. Bigrams have NGRAM_NONE for x and zero is the word boundary.
+   The table follows the trie nodes in the image. */
+typedef struct {
+        guint32 x, y, zq;
+} NGram;
+
+#define NGRAM_NONE 0xffffffff
+#define NGRAM_CHAR(zq) ((zq) >> 8)
+#define NGRAM_VALUE(zq) ((zq) & 0xff)
+
+/* Quantisation steps per halving of the probability */
+#define NGRAM_STEPS 16
+
+/* Bigram probabilities are scaled by 0.4 when there is no trigram */
+#define NGRAM_BACKOFF 21
+
+typedef struct {
+        guint32 x, y, z;
+        double count;
+} NGramCount;
+
+typedef struct {
+        GHashTable *counts;
+        NGram *ngrams;
+        int size;
+} NGramBuild;
+
+typedef struct {
+        guint32 magic, version, source_size, source_mtime, nodes_len,
+                ngrams_size;
+} WordFreqHeader;
+
+/* Words the user enters are learned and kept in a separate list. Every use
+   of a word is appended to the file and the file is rewritten with totals
+   once the uses outgrow the list. The file holds text the user entered, so
+   only the user can read it. */
+#define LEARNED_FILE "wordfreq.learned"
+#define LEARNED_MAX 2048
+
+/* Learned word counts decay by this factor for every word entered after
+   them so that words fall out of the list once they are no longer used */
+#define LEARNED_DECAY 0.999
+
+/* Word context score of a learned word used once, the dictionary scores
+   words by their log count */
+#define LEARNED_WEIGHT 10.
+
+typedef struct {
+        gunichar *string;
+        char *key;
+        double count;
+        int len, stamp;
+} LearnedWord;
+
+/* Dictionaries are loaded when first selected and stay resident */
+#define DICTIONARIES_MAX 32
+
+typedef struct {
+        char *name, *path;
+        const WordNode *nodes;
+        const NGram *ngrams;
+        int nodes_len, ngrams_size, block, loaded;
+} Dictionary;
+
+int wordfreq_enable = TRUE, learn_words = FALSE;
+
+static const WordNode *word_nodes = NULL;
+static const NGram *ngrams = NULL;
+static WordScore *word_scores = NULL;
+static int word_nodes_len, word_scores_len, word_scores_size, ngrams_size;
+static GHashTable *learned_table = NULL;
+static LearnedWord **learned = NULL;
+static int learned_len, learned_clock, learned_lines;
+static Dictionary dictionaries[DICTIONARIES_MAX];
+static char *dictionary_pref = NULL;
+static int dictionaries_len, dictionary = -1, dictionary_selected = -1,
+           *block_dictionaries = NULL, blocks_len, path_len;
+
+static int ucs4_len(const gunichar *str)
+{
+        int len;
+
+        for (len = 0; str[len]; len++);
+        return len;
+}
+
+static int wordfreq_compare(const WordFreq *a, const WordFreq *b)
+{
+        const gunichar *sa = a->string, *sb = b->string;
+
+        for (; *sa && *sa == *sb; sa++, sb++);
+        return *sa < *sb ? -1 : *sa > *sb;
+}
+
+static int parse_wordfreq(char *text, WordFreq **pwords, gunichar **ppool)
+/* Parse the UTF-8 word frequency text. The file format is: word\tcount\n
+   Words are converted to lower-case UCS-4 strings in a single pool, which
+   never needs more characters than the text has bytes. Returns the number
+   of words read. */
+{
+        WordFreq *words = NULL;
+        gunichar *pool, *out;
+        int len = 0, size = 0;
+
+        pool = out = g_malloc((strlen(text) + 1) * sizeof (*pool));
+
+        while (*text) {
+                char *word, *end;
+                int count;
+
+                /* Parse the word */
+                while (*text == ' ' || *text == '\t' || *text == '\r')
+                        text++;
+                word = text;
+                while (*text && *text != '\t' && *text != ' ' &&
+                       *text != '\n')
+                        text++;
+                end = text;
+
+                /* Parse the count */
+                while (*text == ' ' || *text == '\t')
+                        text++;
+                count = atoi(text);
+                while (*text && *text != '\n')
+                        text++;
+                if (*text)
+                        text++;
+                if (end == word)
+                        continue;
+                if (!g_utf8_validate(word, end - word, NULL)) {
+                        g_debug("Skipping invalid UTF-8 word");
+                        continue;
+                }
+
+                /* Add the word */
+                if (len >= size) {
+                        size = size ? size * 2 : 16384;
+                        words = g_realloc(words, size * sizeof (*words));
+                }
+                words[len].string = out;
+                words[len].count = count > 1 ? log(count) : 0;
+                words[len].freq = count > 0 ? count : 0;
+                for (; word < end; word = g_utf8_next_char(word))
+                        *out++ = g_unichar_tolower(g_utf8_get_char(word));
+                *out++ = 0;
+                len++;
+        }
+        *pwords = words;
+        *ppool = pool;
+        return len;
+}
+
+static WordNode *build_word_nodes(WordFreq *words, int words_len, int *plen)
+/* Build the trie from the word frequency table. The table is sorted and the
+   trie is laid out breadth-first so that every node's children can be
+   allocated together as soon as the node is reached. */
+{
+        WordNode *nodes;
+        double *end_freq;
+        int i, len, size, *lo, *hi, *depth;
+
+        /* There cannot be more nodes than there are characters. Each node
+           covers a range of words in the sorted table. */
+        qsort(words, words_len, sizeof (*words),
+              (GCompareFunc)wordfreq_compare);
+        for (i = 0, size = 1; i < words_len; i++)
+                size += ucs4_len(words[i].string);
+        nodes = g_malloc(size * sizeof (*nodes));
+        lo = g_malloc(size * sizeof (*lo));
+        hi = g_malloc(size * sizeof (*hi));
+        depth = g_malloc(size * sizeof (*depth));
+        end_freq = g_malloc0(size * sizeof (*end_freq));
+        memset(nodes, 0, sizeof (*nodes));
+        lo[0] = 0;
+        hi[0] = words_len;
+        depth[0] = 0;
+        len = 1;
+        for (i = 0; i < len; i++) {
+                WordNode *node = nodes + i;
+                int j, d = depth[i];
+
+                node->children = len;
+                for (j = lo[i]; j < hi[i]; j++) {
+                        gunichar ch = words[j].string[d];
+
+                        node->count += words[j].count;
+
+                        /* Words that end here and words that continue with a
+                           character we already have a child for */
+                        if (!ch) {
+                                end_freq[i] += words[j].freq;
+                                continue;
+                        }
+                        if (node->children_len && nodes[len - 1].ch == ch) {
+                                hi[len - 1] = j + 1;
+                                continue;
+                        }
+
+                        /* New child */
+                        nodes[len].ch = ch;
+                        nodes[len].children = 0;
+                        nodes[len].children_len = 0;
+                        nodes[len].count = 0;
+                        nodes[len].end = 0;
+                        nodes[len].best = 0;
+                        lo[len] = j;
+                        hi[len] = j + 1;
+                        depth[len] = d + 1;
+                        len++;
+                        node->children_len++;
+                }
+        }
+
+        /* Children always come after their parent, so going backwards every
+           node's best rank is final before it reaches the parent */
+        for (i = len - 1; i >= 0; i--) {
+                int j;
+
+                if (end_freq[i] > 0.) {
+                        nodes[i].end = 1 + RANK_STEPS * log(end_freq[i]);
+                        if (nodes[i].end > nodes[i].best)
+                                nodes[i].best = nodes[i].end;
+                }
+                for (j = 0; j < (int)nodes[i].children_len; j++)
+                        if (nodes[nodes[i].children + j].best > nodes[i].best)
+                                nodes[i].best =
+                                        nodes[nodes[i].children + j].best;
+        }
+        g_free(end_freq);
+        g_free(lo);
+        g_free(hi);
+        g_free(depth);
+        *plen = len;
+        return g_realloc(nodes, len * sizeof (*nodes));
+}
+
+static guint ngram_hash(guint32 x, guint32 y, guint32 z)
+{
+        guint32 hash;
+
+        hash = x * 0x9e3779b1u;
+        hash = (hash ^ y) * 0x85ebca6bu;
+        hash = (hash ^ z) * 0xc2b2ae35u;
+        return hash ^ (hash >> 16);
+}
+
+static guint ngram_count_hash(const NGramCount *n)
+{
+        return ngram_hash(n->x, n->y, n->z);
+}
+
+static gboolean ngram_count_equal(const NGramCount *a, const NGramCount *b)
+{
+        return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+static void count_ngram(GHashTable *table, guint32 x, guint32 y, guint32 z,
+                        double count)
+{
+        NGramCount key, *entry;
+
+        key.x = x;
+        key.y = y;
+        key.z = z;
+        entry = g_hash_table_lookup(table, &key);
+        if (!entry) {
+                entry = g_malloc(sizeof (*entry));
+                *entry = key;
+                entry->count = 0.;
+                g_hash_table_insert(table, entry, entry);
+        }
+        entry->count += count;
+}
+
+static void add_ngram(NGramCount *entry, gpointer value, NGramBuild *build)
+/* Quantise an n-gram probability and add it to the table */
+{
+        NGramCount key, *context;
+        double p;
+        guint32 i, mask = build->size - 1;
+        int q;
+
+        if (!entry->z)
+                return;
+        key = *entry;
+        key.z = 0;
+        context = g_hash_table_lookup(build->counts, &key);
+        p = entry->count / context->count;
+        q = 255 + NGRAM_STEPS * log(p) / log(2.) + 0.5;
+        if (q < 1)
+                q = 1;
+        if (q > 255)
+                q = 255;
+        for (i = ngram_hash(entry->x, entry->y, entry->z) & mask;
+             build->ngrams[i].zq; i = (i + 1) & mask);
+        build->ngrams[i].x = entry->x;
+        build->ngrams[i].y = entry->y;
+        build->ngrams[i].zq = entry->z << 8 | q;
+}
+
+static NGram *build_ngrams(const WordFreq *words, int words_len, int *psize)
+/* Count the character bigrams and trigrams in the dictionary and build the
+   quantised table. Context totals are counted with a zero z. */
+{
+        NGramBuild build;
+        int i;
+
+        build.counts = g_hash_table_new_full((GHashFunc)ngram_count_hash,
+                                             (GEqualFunc)ngram_count_equal,
+                                             g_free, NULL);
+        for (i = 0; i < words_len; i++) {
+                const gunichar *p;
+                guint32 x = 0, y = 0;
+
+                if (!words[i].freq)
+                        continue;
+                for (p = words[i].string; *p; p++) {
+                        count_ngram(build.counts, x, y, *p, words[i].freq);
+                        count_ngram(build.counts, x, y, 0, words[i].freq);
+                        count_ngram(build.counts, NGRAM_NONE, y, *p,
+                                    words[i].freq);
+                        count_ngram(build.counts, NGRAM_NONE, y, 0,
+                                    words[i].freq);
+                        x = y;
+                        y = *p;
+                }
+        }
+
+        /* Keep the table at most half full */
+        for (build.size = 1024;
+             build.size < (int)g_hash_table_size(build.counts) * 2;
+             build.size *= 2);
+        build.ngrams = g_malloc0(build.size * sizeof (*build.ngrams));
+        g_hash_table_foreach(build.counts, (GHFunc)add_ngram, &build);
+        g_hash_table_destroy(build.counts);
+        *psize = build.size;
+        return build.ngrams;
+}
+
+static int ngram_lookup(guint32 x, guint32 y, guint32 z)
+/* Returns the quantised probability of an n-gram or zero if it was never
+   seen */
+{
+        guint32 i, mask = ngrams_size - 1;
+
+        for (i = ngram_hash(x, y, z) & mask; ngrams[i].zq; i = (i + 1) & mask)
+                if (ngrams[i].x == x && ngrams[i].y == y &&
+                    NGRAM_CHAR(ngrams[i].zq) == z)
+                        return NGRAM_VALUE(ngrams[i].zq);
+        return 0;
+}
+
+static int map_wordfreq(const char *path, const struct stat *source,
+                        Dictionary *dict)
+/* Map a compiled word frequency image. The mapping is read-only and shared
+   so every instance uses the same pages. Returns FALSE if there is no image
+   or it is out of date. */
+{
+        const WordFreqHeader *header;
+        struct stat st;
+        void *map;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return FALSE;
+        if (fstat(fd, &st) || st.st_size < (off_t)sizeof (*header)) {
+                close(fd);
+                return FALSE;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                log_errno(va("Failed to map word frequency image '%s'", path));
+                return FALSE;
+        }
+        header = map;
+        if (header->magic != WORDFREQ_MAGIC ||
+            header->version != WORDFREQ_VERSION ||
+            header->source_size != (guint32)source->st_size ||
+            header->source_mtime != (guint32)source->st_mtime ||
+            header->nodes_len < 1 ||
+            header->ngrams_size & (header->ngrams_size - 1) ||
+            st.st_size != (off_t)(sizeof (*header) +
+                                  header->nodes_len * sizeof (WordNode) +
+                                  header->ngrams_size * sizeof (NGram))) {
+                g_debug("Word frequency image '%s' is out of date", path);
+                munmap(map, st.st_size);
+                return FALSE;
+        }
+        dict->nodes = (const WordNode *)(header + 1);
+        dict->nodes_len = header->nodes_len;
+        dict->ngrams = (const NGram *)(dict->nodes + dict->nodes_len);
+        dict->ngrams_size = header->ngrams_size;
+        g_debug("Mapped word frequency image '%s' with %d nodes and %d "
+                "n-gram slots", path, dict->nodes_len, dict->ngrams_size);
+        return TRUE;
+}
+
+static int write_wordfreq(const char *path, const struct stat *source,
+                          const WordNode *nodes, int nodes_len,
+                          const NGram *ngrams, int ngrams_size)
+/* Write a compiled word frequency image. The image is written to a
+   temporary file first so other instances never map a partial image.
+   Returns TRUE on success. */
 {
-        GIOChannel *channel;
+        WordFreqHeader header;
         GError *error = NULL;
-        char buf[64], *path;
-        gsize bytes_read = 1;
+        char *contents;
+        gsize size;
+        int result;
+
+        header.magic = WORDFREQ_MAGIC;
+        header.version = WORDFREQ_VERSION;
+        header.source_size = source->st_size;
+        header.source_mtime = source->st_mtime;
+        header.nodes_len = nodes_len;
+        header.ngrams_size = ngrams_size;
+        size = sizeof (header) + nodes_len * sizeof (*nodes) +
+               ngrams_size * sizeof (*ngrams);
+        contents = g_malloc(size);
+        memcpy(contents, &header, sizeof (header));
+        memcpy(contents + sizeof (header), nodes, nodes_len * sizeof (*nodes));
+        memcpy(contents + sizeof (header) + nodes_len * sizeof (*nodes),
+               ngrams, ngrams_size * sizeof (*ngrams));
+        result = g_file_set_contents(path, contents, size, &error);
+        g_free(contents);
+        if (!result) {
+                g_warning("Failed to write word frequency image '%s': %s",
+                          path, error->message);
+                g_error_free(error);
+        }
+        return result;
+}
+
+static int word_node_child(int node, gunichar ch)
+/* Find a child of a node by character. Returns -1 if there is none. */
+{
+        int lo, hi;
+
+        lo = word_nodes[node].children;
+        hi = lo + word_nodes[node].children_len;
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+
+                if (word_nodes[mid].ch < ch)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (lo < (int)(word_nodes[node].children +
+                       word_nodes[node].children_len) &&
+            word_nodes[lo].ch == ch)
+                return lo;
+        return -1;
+}
+
+static int word_node_descend(int node, const gunichar *str, int len)
+/* Follow a string down from a node. Returns -1 if no word continues with
+   it. */
+{
+        int i;
+
+        for (i = 0; i < len && node >= 0; i++)
+                node = word_node_child(node, g_unichar_tolower(str[i]));
+        return node;
+}
+
+static int word_node_find(const gunichar *pre, int len)
+/* Find the node for a word prefix. The path to the last prefix is kept so
+   that when the prefix grows or changes at the end we only look up the new
+   characters. */
+{
+        static gunichar path_pre[WORD_MAX];
+        static int path_nodes[WORD_MAX + 1];
+        int i;
+
+        if (!word_nodes || len >= WORD_MAX)
+                return -1;
+        path_nodes[0] = 0;
+        for (i = 0; i < path_len && i < len &&
+             path_pre[i] == g_unichar_tolower(pre[i]); i++);
+        for (; i < len; i++) {
+                int child;
+
+                path_pre[i] = g_unichar_tolower(pre[i]);
+                child = word_node_child(path_nodes[i], path_pre[i]);
+                if (child < 0) {
+                        path_len = i;
+                        return -1;
+                }
+                path_nodes[i + 1] = child;
+        }
+        path_len = len;
+        return path_nodes[len];
+}
+
+int wordfreq_child(int node, gunichar ch)
+/* Follow a character down the dictionary from a node, zero is the start of a
+   word. Returns -1 if no word continues with the character. */
+{
+        if (!word_nodes || node < 0)
+                return -1;
+        return word_node_child(node, g_unichar_tolower(ch));
+}
+
+int wordfreq_ends(int node)
+/* Returns the total count of the words that end at a node */
+{
+        int i, count;
+
+        if (!word_nodes || node < 0)
+                return 0;
+        count = word_nodes[node].count;
+        for (i = 0; i < (int)word_nodes[node].children_len; i++)
+                count -= word_nodes[word_nodes[node].children + i].count;
+        return count;
+}
+
+/*
+        Learned words
+*/
+
+static double learned_count(const LearnedWord *word)
+{
+        return word->count * pow(LEARNED_DECAY, learned_clock - word->stamp);
+}
+
+static int learned_score(const LearnedWord *word)
+/* Word context score for a learned word, comparable to the log counts of
+   the dictionary */
+{
+        int score;
+
+        score = LEARNED_WEIGHT + log(learned_count(word));
+        return score > 1 ? score : 1;
+}
+
+static int learned_rank(const LearnedWord *word)
+/* Completion rank for a learned word, comparable to the dictionary ranks */
+{
+        int rank;
+
+        rank = 1 + RANK_STEPS * (LEARNED_WEIGHT + log(learned_count(word)));
+        return rank > 1 ? rank : 1;
+}
+
+static int learned_match(const gunichar *word, const gunichar *str, int len)
+/* Check if a lower-case word starts with a string in any case */
+{
         int i;
 
-        wordfreqs[0].string[0] = 0;
+        for (i = 0; i < len && word[i] == g_unichar_tolower(str[i]); i++);
+        return i >= len;
+}
+
+static int learned_compare(LearnedWord **a, LearnedWord **b)
+{
+        double ca = learned_count(*a), cb = learned_count(*b);
+
+        return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void learned_prune(void)
+/* Forget the least used quarter of the learned words */
+{
+        int i, len;
+
+        qsort(learned, learned_len, sizeof (*learned),
+              (GCompareFunc)learned_compare);
+        len = learned_len - learned_len / 4;
+        for (i = len; i < learned_len; i++) {
+                g_hash_table_remove(learned_table, learned[i]->key);
+                g_free(learned[i]->string);
+                g_free(learned[i]->key);
+                g_free(learned[i]);
+        }
+        learned_len = len;
+}
+
+static void learned_add(const char *key, double count)
+/* Add to the count of a lower-case UTF-8 word */
+{
+        LearnedWord *word;
+        glong len;
 
-        /* Try to open the user's word frequency file */
-        path = g_build_filename(g_get_home_dir(), "." PACKAGE, "wordfreq",
+        word = g_hash_table_lookup(learned_table, key);
+        if (!word) {
+                if (learned_len >= LEARNED_MAX)
+                        learned_prune();
+                word = g_malloc(sizeof (*word));
+                word->string = g_utf8_to_ucs4_fast(key, -1, &len);
+                word->len = len;
+                word->key = g_strdup(key);
+                word->count = 0.;
+                word->stamp = learned_clock;
+                g_hash_table_insert(learned_table, word->key, word);
+                learned[learned_len++] = word;
+        }
+        word->count = learned_count(word) + count;
+        word->stamp = learned_clock;
+}
+
+static char *learned_path(void)
+{
+        return g_build_filename(g_get_home_dir(), "." PACKAGE, LEARNED_FILE,
                                 NULL);
-        channel = g_io_channel_new_file(path, "r", &error);
-        if (error) {
-                g_debug("User does not have a word frequency file, "
-                        "loading system file");
-                channel = NULL;
+}
+
+static void load_learned(void)
+/* Read the learned words file. Lines with a count are totals, lines without
+   are single uses of the word in the order they were entered. */
+{
+        char *path, *text, *line, *next;
+
+        if (learned_table)
+                return;
+        learned_table = g_hash_table_new(g_str_hash, g_str_equal);
+        learned = g_malloc(LEARNED_MAX * sizeof (*learned));
+        path = learned_path();
+        if (!g_file_get_contents(path, &text, NULL, NULL)) {
+                g_free(path);
+                return;
         }
-        error = NULL;
         g_free(path);
+        for (line = text; *line; line = next) {
+                char *tab;
 
-        /* Open the word frequency file */
-        if (!channel) {
-                path = g_build_filename(PKGDATADIR, "wordfreq", NULL);
-                channel = g_io_channel_new_file(path, "r", &error);
-                if (error) {
-                        g_warning("Failed to open system word frequency file "
-                                  "'%s' for reading: %s", path, error->message);
-                        g_free(path);
-                        return;
+                next = strchr(line, '\n');
+                if (next)
+                        *next++ = 0;
+                else
+                        next = line + strlen(line);
+                learned_lines++;
+                tab = strchr(line, '\t');
+                if (tab)
+                        *tab++ = 0;
+                if (!*line || !g_utf8_validate(line, -1, NULL))
+                        continue;
+                if (tab)
+                        learned_add(line, g_ascii_strtod(tab, NULL));
+                else {
+                        learned_clock++;
+                        learned_add(line, 1.);
                 }
-                g_free(path);
         }
+        g_free(text);
+        g_debug("Learned %d words", learned_len);
+}
 
-        /* Read in every entry */
-        g_debug("Parsing word frequency list");
-        wordfreqs_count = 0;
-        for (i = 0; bytes_read > 0 && i < WORDFREQS; i++) {
-                char *pbuf;
-                int swap, len;
+static int write_learned(const char *path, const GString *text)
+/* Replace the learned words file, readable only by the user. Returns TRUE
+   on success. */
+{
+        char *tmp_path;
+        int fd, result;
 
-                /* Read a line */
-                pbuf = buf - 1;
-                do {
-                        g_io_channel_read_chars(channel, ++pbuf, 1,
-                                                &bytes_read, &error);
-                } while (bytes_read > 0 && *pbuf != '\n' &&
-                         pbuf < buf + sizeof (buf));
-                *pbuf = 0;
+        tmp_path = g_strconcat(path, ".tmp", NULL);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+                g_free(tmp_path);
+                return FALSE;
+        }
+        result = write(fd, text->str, text->len) == (ssize_t)text->len;
+        if (close(fd))
+                result = FALSE;
+        if (result)
+                result = !rename(tmp_path, path);
+        if (!result)
+                remove(tmp_path);
+        g_free(tmp_path);
+        return result;
+}
 
-                /* Parse the word */
-                pbuf = buf;
-                while (*pbuf && *pbuf != '\t' && *pbuf != ' ')
-                        pbuf++;
-                if (buf == pbuf) {
-                        i--;
+static void save_learned(GString *uses)
+/* Append word uses to the learned words file or write out the totals if
+   the file has grown too long */
+{
+        char *path;
+        int fd;
+
+        path = learned_path();
+        if (learned_lines <= learned_len * 2 + 64) {
+                fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+                /* Files written before were readable by everyone */
+                if (fd >= 0 && fchmod(fd, 0600))
+                        log_errno("Failed to protect learned words file");
+                if (fd >= 0) {
+                        if (write(fd, uses->str, uses->len) ==
+                            (ssize_t)uses->len) {
+                                close(fd);
+                                g_free(path);
+                                return;
+                        }
+                        close(fd);
+                }
+                log_errno(va("Failed to append to learned words file '%s'",
+                             path));
+        }
+
+        /* Rewrite the file with totals */
+        g_string_truncate(uses, 0);
+        if (learned_len) {
+                int i;
+
+                for (i = 0; i < learned_len; i++) {
+                        char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+                        g_ascii_formatd(buf, sizeof (buf), "%.4g",
+                                        learned_count(learned[i]));
+                        g_string_append_printf(uses, "%s\t%s\n",
+                                               learned[i]->key, buf);
+                }
+        }
+        if (write_learned(path, uses))
+                learned_lines = learned_len;
+        else
+                g_warning("Failed to write learned words file '%s'", path);
+        g_free(path);
+}
+
+int wordfreq_learned(const gunichar *string, int len)
+/* Returns the score of a learned word or zero if it has not been learned */
+{
+        LearnedWord *word;
+        gunichar lower[WORD_MAX];
+        char *key;
+        int i;
+
+        if (!learned_len || len >= WORD_MAX)
+                return 0;
+        for (i = 0; i < len; i++)
+                lower[i] = g_unichar_tolower(string[i]);
+        key = g_ucs4_to_utf8(lower, len, NULL, NULL, NULL);
+        if (!key)
+                return 0;
+        word = g_hash_table_lookup(learned_table, key);
+        g_free(key);
+        return word ? learned_score(word) : 0;
+}
+
+void wordfreq_learn(const gunichar *text)
+/* Learn the words in entered text */
+{
+        GString *uses;
+
+        if (!wordfreq_enable || !learn_words || !learned_table)
+                return;
+        uses = g_string_sized_new(64);
+        while (*text) {
+                const gunichar *end;
+                gunichar word[WORD_MAX];
+                char *key;
+                int i, len;
+
+                for (; *text && !g_unichar_isalnum(*text); text++);
+                for (end = text; g_unichar_isalnum(*end); end++);
+                len = end - text;
+                if (len < 2 || len >= WORD_MAX) {
+                        text = end;
                         continue;
                 }
-                swap = *pbuf;
-                *pbuf = 0;
-                len = pbuf - buf;
-                if (len >= (int)sizeof (wordfreqs[i].string))
-                        len = sizeof (wordfreqs[i].string) - 1;
-                memcpy(wordfreqs[i].string, buf, len);
-                wordfreqs[i].string[len] = 0;
 
-                /* Parse the count */
-                *pbuf = swap;
-                while (*pbuf == ' ' || *pbuf == '\t')
-                        pbuf++;
-                wordfreqs_count += wordfreqs[i].count = log(atoi(pbuf));
+                /* Numbers are not words */
+                for (i = 0; i < len && g_unichar_isdigit(text[i]); i++);
+                if (i >= len) {
+                        text = end;
+                        continue;
+                }
+
+                /* Words are kept in lower-case like the dictionary */
+                for (i = 0; i < len; i++)
+                        word[i] = g_unichar_tolower(text[i]);
+                text = end;
+                key = g_ucs4_to_utf8(word, len, NULL, NULL, NULL);
+                if (!key)
+                        continue;
+                learned_clock++;
+                learned_add(key, 1.);
+                g_string_append(uses, key);
+                g_string_append_c(uses, '\n');
+                learned_lines++;
+                g_free(key);
+        }
+        if (uses->len)
+                save_learned(uses);
+        g_string_free(uses, TRUE);
+}
+
+/*
+        Word completion
+*/
+
+static gunichar (*complete_words)[COMPLETION_LEN], complete_buf[COMPLETION_LEN];
+static int complete_scores[COMPLETION_LEN], complete_len, complete_max;
+
+static void complete_add(const gunichar *suffix, int len, int score)
+/* Add a completion to the list that is kept sorted by score */
+{
+        int i, j;
+
+        /* Learned words may already be in the list */
+        for (i = 0; i < complete_len; i++) {
+                for (j = 0; j < len && complete_words[i][j] == suffix[j];
+                     j++);
+                if (j == len && !complete_words[i][j]) {
+                        if (score <= complete_scores[i])
+                                return;
+                        memmove(complete_words + i, complete_words + i + 1,
+                                (complete_len - i - 1) *
+                                sizeof (*complete_words));
+                        memmove(complete_scores + i, complete_scores + i + 1,
+                                (complete_len - i - 1) *
+                                sizeof (*complete_scores));
+                        complete_len--;
+                        break;
+                }
+        }
+
+        /* Find the position and shift worse completions down */
+        for (i = complete_len; i > 0 && complete_scores[i - 1] < score; i--);
+        if (i >= complete_max)
+                return;
+        if (complete_len < complete_max)
+                complete_len++;
+        memmove(complete_words + i + 1, complete_words + i,
+                (complete_len - i - 1) * sizeof (*complete_words));
+        memmove(complete_scores + i + 1, complete_scores + i,
+                (complete_len - i - 1) * sizeof (*complete_scores));
+        memcpy(complete_words[i], suffix, len * sizeof (*suffix));
+        complete_words[i][len] = 0;
+        complete_scores[i] = score;
+}
+
+static void complete_node(int node, int depth)
+/* Search the words under a node. No word under a node ranks higher than its
+   best rank, so subtrees that cannot beat the worst completion kept so far
+   are skipped. */
+{
+        const WordNode *pn = word_nodes + node;
+        int i;
+
+        if (complete_len >= complete_max &&
+            (int)pn->best <= complete_scores[complete_len - 1])
+                return;
+        if (depth && pn->end)
+                complete_add(complete_buf, depth, pn->end);
+        if (depth >= COMPLETION_LEN - 1)
+                return;
+        for (i = 0; i < (int)pn->children_len; i++) {
+                complete_buf[depth] = word_nodes[pn->children + i].ch;
+                complete_node(pn->children + i, depth + 1);
+        }
+}
+
+int wordfreq_complete(const gunichar *pre, int pre_len,
+                      gunichar (*words)[COMPLETION_LEN], int max)
+/* Find the most frequent words that start with a prefix. The rest of each
+   word is returned in the case the prefix is written in. Returns the number
+   of completions found. */
+{
+        int i, j, node, upper;
+
+        if (!wordfreq_enable || pre_len < 1 || max < 1 ||
+            max > COMPLETION_LEN)
+                return 0;
+        complete_words = words;
+        complete_max = max;
+        complete_len = 0;
+        node = word_node_find(pre, pre_len);
+        if (node >= 0)
+                complete_node(node, 0);
+
+        /* Learned words */
+        for (i = 0; i < learned_len; i++) {
+                const LearnedWord *word = learned[i];
+
+                if (word->len > pre_len &&
+                    word->len - pre_len < COMPLETION_LEN &&
+                    learned_match(word->string, pre, pre_len))
+                        complete_add(word->string + pre_len,
+                                     word->len - pre_len,
+                                     learned_rank(word));
         }
-        wordfreqs[i].string[0] = 0;
-        wordfreqs_len = i;
-        g_io_channel_unref(channel);
-        g_debug("%d words parsed", i);
 
-        return;
+        /* Words written in capitals are completed in capitals */
+        upper = pre_len > 1 && g_unichar_isupper(pre[pre_len - 1]) &&
+                g_unichar_isupper(pre[pre_len - 2]);
+        if (upper)
+                for (i = 0; i < complete_len; i++)
+                        for (j = 0; words[i][j]; j++)
+                                words[i][j] = g_unichar_toupper(words[i][j]);
+        return complete_len;
+}
+
+/*
+        Dictionaries
+*/
+
+static int dictionary_compare(const Dictionary *a, const Dictionary *b)
+/* The default dictionary goes first, the rest are sorted by name */
+{
+        if (!strcmp(a->name, "default"))
+                return -1;
+        if (!strcmp(b->name, "default"))
+                return 1;
+        return strcmp(a->name, b->name);
+}
+
+static int char_block(gunichar ch)
+{
+        int i;
+
+        for (i = 0; unicode_blocks[i].name; i++)
+                if (ch >= (gunichar)unicode_blocks[i].start &&
+                    ch <= (gunichar)unicode_blocks[i].end)
+                        return i;
+        return -1;
+}
+
+static int dictionary_block(const char *path)
+/* Word frequency files list the most frequent words first, so the first
+   letter in the file tells us which Unicode block the dictionary is for */
+{
+        char buf[256], *p;
+        ssize_t len;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        len = read(fd, buf, sizeof (buf) - 1);
+        close(fd);
+        if (len <= 0)
+                return -1;
+        buf[len] = 0;
+        for (p = buf; *p; p = g_utf8_next_char(p)) {
+                gunichar ch;
+
+                ch = g_utf8_get_char_validated(p, -1);
+                if (ch == (gunichar)-1 || ch == (gunichar)-2)
+                        break;
+                if (g_unichar_isalpha(ch))
+                        return char_block(ch);
+        }
+        return -1;
+}
+
+static void scan_dictionaries(const char *dir)
+/* Find the word frequency files in a directory. Files in directories that
+   were scanned first take precedence. */
+{
+        GDir *gdir;
+        const char *file;
+
+        gdir = g_dir_open(dir, 0, NULL);
+        if (!gdir)
+                return;
+        while ((file = g_dir_read_name(gdir)) &&
+               dictionaries_len < DICTIONARIES_MAX) {
+                Dictionary *dict;
+                const char *name;
+                int i;
+
+                if (!strcmp(file, WORDFREQ_FILE))
+                        name = "default";
+                else if (!strncmp(file, WORDFREQ_FILE "-",
+                                  sizeof (WORDFREQ_FILE)) &&
+                         file[sizeof (WORDFREQ_FILE)] &&
+                         !strstr(file, WORDFREQ_IMAGE) &&
+                         !strchr(file, ' '))
+                        name = file + sizeof (WORDFREQ_FILE);
+                else
+                        continue;
+                for (i = 0; i < dictionaries_len &&
+                     strcmp(dictionaries[i].name, name); i++);
+                if (i < dictionaries_len)
+                        continue;
+                dict = dictionaries + dictionaries_len++;
+                memset(dict, 0, sizeof (*dict));
+                dict->name = g_strdup(name);
+                dict->path = g_build_filename(dir, file, NULL);
+                dict->block = dictionary_block(dict->path);
+        }
+        g_dir_close(gdir);
+}
+
+static int load_dictionary(Dictionary *dict)
+/* Load a dictionary the first time it is used. Returns FALSE if it could
+   not be loaded. */
+{
+        GError *error = NULL;
+        WordFreq *words;
+        WordNode *nodes;
+        NGram *new_ngrams;
+        struct stat st;
+        gunichar *pool;
+        char *image_path, *text, *base;
+        int words_len, nodes_len, new_ngrams_size;
+
+        if (dict->loaded)
+                return dict->nodes != NULL;
+        dict->loaded = TRUE;
+        if (stat(dict->path, &st)) {
+                log_errno(va("Failed to open word frequency file '%s'",
+                             dict->path));
+                return FALSE;
+        }
+
+        /* Try an image installed alongside the file, then our own */
+        image_path = g_strconcat(dict->path, WORDFREQ_IMAGE, NULL);
+        if (map_wordfreq(image_path, &st, dict)) {
+                g_free(image_path);
+                return TRUE;
+        }
+        g_free(image_path);
+        base = g_path_get_basename(dict->path);
+        image_path = g_strconcat(g_get_home_dir(), G_DIR_SEPARATOR_S "."
+                                 PACKAGE G_DIR_SEPARATOR_S, base,
+                                 WORDFREQ_IMAGE, NULL);
+        g_free(base);
+        if (map_wordfreq(image_path, &st, dict)) {
+                g_free(image_path);
+                return TRUE;
+        }
+
+        /* Compile the text file */
+        if (!g_file_get_contents(dict->path, &text, NULL, &error)) {
+                g_warning("Failed to read word frequency file '%s': %s",
+                          dict->path, error->message);
+                g_error_free(error);
+                g_free(image_path);
+                return FALSE;
+        }
+        g_debug("Compiling word frequency list '%s'", dict->path);
+        words_len = parse_wordfreq(text, &words, &pool);
+        g_free(text);
+        nodes = build_word_nodes(words, words_len, &nodes_len);
+        new_ngrams = build_ngrams(words, words_len, &new_ngrams_size);
+        g_free(words);
+        g_free(pool);
+        g_debug("%d words indexed with %d nodes", words_len, nodes_len);
+
+        /* Map the image we just wrote so that the pages are shared with
+           other instances, otherwise just use the tables from the heap */
+        if (write_wordfreq(image_path, &st, nodes, nodes_len,
+                           new_ngrams, new_ngrams_size) &&
+            map_wordfreq(image_path, &st, dict)) {
+                g_free(nodes);
+                g_free(new_ngrams);
+        } else {
+                dict->nodes = nodes;
+                dict->nodes_len = nodes_len;
+                dict->ngrams = new_ngrams;
+                dict->ngrams_size = new_ngrams_size;
+        }
+        g_free(image_path);
+        return TRUE;
+}
+
+static void use_dictionary(int index)
+/* Switch the tables in use to another dictionary */
+{
+        Dictionary *dict;
+
+        if (index == dictionary || index < 0 || index >= dictionaries_len)
+                return;
+        dict = dictionaries + index;
+        if (!load_dictionary(dict))
+                return;
+        dictionary = index;
+        word_nodes = dict->nodes;
+        word_nodes_len = dict->nodes_len;
+        ngrams = dict->ngrams;
+        ngrams_size = dict->ngrams_size;
+        path_len = 0;
+        g_debug("Using '%s' dictionary", dict->name);
+}
+
+static void use_dictionary_for(const gunichar *pre, int pre_len)
+/* Switch to the dictionary for the script the word is written in */
+{
+        static int block = -1;
+        gunichar ch;
+
+        if (!pre_len || !block_dictionaries)
+                return;
+        ch = pre[pre_len - 1];
+        if (!g_unichar_isalpha(ch))
+                return;
+        if (block < 0 || ch < (gunichar)unicode_blocks[block].start ||
+            ch > (gunichar)unicode_blocks[block].end)
+                block = char_block(ch);
+        if (block >= 0 && block_dictionaries[block] >= 0)
+                use_dictionary(block_dictionaries[block]);
+}
+
+void wordfreq_select(int index)
+/* Select a dictionary for its Unicode block */
+{
+        if (index < 0 || index >= dictionaries_len)
+                return;
+        dictionary_selected = index;
+        g_free(dictionary_pref);
+        dictionary_pref = g_strdup(dictionaries[index].name);
+        if (block_dictionaries && dictionaries[index].block >= 0)
+                block_dictionaries[dictionaries[index].block] = index;
+        use_dictionary(index);
+}
+
+int wordfreq_dictionaries(void)
+{
+        return dictionaries_len;
+}
+
+const char *wordfreq_dictionary_name(int index)
+{
+        if (index < 0 || index >= dictionaries_len)
+                return NULL;
+        return dictionaries[index].name;
+}
+
+int wordfreq_dictionary(void)
+{
+        return dictionary_selected;
+}
+
+static void select_dictionary_pref(void)
+{
+        int i;
+
+        for (i = 0; i < dictionaries_len; i++)
+                if (dictionary_pref &&
+                    !strcmp(dictionaries[i].name, dictionary_pref)) {
+                        wordfreq_select(i);
+                        return;
+                }
+        wordfreq_select(0);
+}
+
+void wordfreq_sync(void)
+/* Read or write the selected dictionary */
+{
+        const char *name;
+
+        if (profile_read_only) {
+                name = profile_read();
+                if (!name[0])
+                        return;
+                g_free(dictionary_pref);
+                dictionary_pref = g_strdup(name);
+                if (dictionaries_len)
+                        select_dictionary_pref();
+                return;
+        }
+        if (dictionary_pref)
+                profile_write(va("dictionary %s\n", dictionary_pref));
+}
+
+void load_wordfreq(void)
+/* Find the word frequency files. Only the selected dictionary is loaded
+   now, the others are loaded when they are first needed. */
+{
+        char *path;
+        int i;
+
+        load_learned();
+
+        /* User files override system files with the same name */
+        path = g_build_filename(g_get_home_dir(), "." PACKAGE, NULL);
+        scan_dictionaries(path);
+        g_free(path);
+        scan_dictionaries(PKGDATADIR);
+        if (!dictionaries_len) {
+                g_warning("No word frequency files found");
+                return;
+        }
+        qsort(dictionaries, dictionaries_len, sizeof (*dictionaries),
+              (GCompareFunc)dictionary_compare);
+
+        /* The first dictionary for each block is used for it until another
+           is selected */
+        for (blocks_len = 0; unicode_blocks[blocks_len].name; blocks_len++);
+        block_dictionaries = g_malloc(blocks_len * sizeof (*block_dictionaries));
+        for (i = 0; i < blocks_len; i++)
+                block_dictionaries[i] = -1;
+        for (i = dictionaries_len - 1; i >= 0; i--)
+                if (dictionaries[i].block >= 0)
+                        block_dictionaries[dictionaries[i].block] = i;
+        select_dictionary_pref();
+}
+
+static void add_word_score(gunichar ch, int score)
+{
+        if (word_scores_len >= word_scores_size) {
+                word_scores_size = word_scores_size ? word_scores_size * 2 : 64;
+                word_scores = g_realloc(word_scores, word_scores_size *
+                                                     sizeof (*word_scores));
+        }
+        word_scores[word_scores_len].ch = ch;
+        word_scores[word_scores_len++].score = score;
+}
+
+static void add_case_scores(const gunichar *pre, int pre_len, gunichar ch,
+                            int score)
+/* Score a lower-case character following a prefix in the case or cases it
+   could be written in */
+{
+        gunichar ch_lower = ch, ch_upper = 0;
+
+        if (!g_unichar_isgraph(ch))
+                return;
+
+        /* Suggest proper case */
+        if (g_unichar_isalpha(ch)) {
+                ch_upper = g_unichar_toupper(ch);
+                if (ch_upper == ch_lower)
+                        ch_upper = 0;
+                else if (pre_len > 1) {
+                        if (g_unichar_islower(pre[pre_len - 1]))
+                                ch_upper = 0;
+                        else if (g_unichar_isupper(pre[pre_len - 1]) &&
+                                 g_unichar_isupper(pre[pre_len - 2]))
+                                ch_lower = 0;
+                }
+        }
+
+        if (ch_lower)
+                add_word_score(ch_lower, score);
+        if (ch_upper)
+                add_word_score(ch_upper, score);
+}
+
+static int word_score_compare(const WordScore *a, const WordScore *b)
+{
+        return a->ch < b->ch ? -1 : a->ch > b->ch;
+}
+
+static int word_score(gunichar ch)
+/* Look up the score for a character in the sorted scores */
+{
+        int lo = 0, hi = word_scores_len;
+
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+
+                if (word_scores[mid].ch < ch)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (lo < word_scores_len && word_scores[lo].ch == ch)
+                return word_scores[lo].score;
+        return 0;
 }
 
 void engine_wordfreq(void)
 {
         Sample *sample;
-        const char *pre, *post;
-        int i, pre_len, post_len, chars[128];
+        const gunichar *pre, *post;
+        int i, j, node, pre_len, post_len, max;
 
         if (!wordfreq_enable)
                 return;
         pre = cell_widget_word();
-        pre_len = strlen(pre);
+        pre_len = ucs4_len(pre);
         post = pre + pre_len + 1;
-        post_len = strlen(post);
+        post_len = ucs4_len(post);
         if (!pre_len && !post_len)
                 return;
-        memset(chars, 0, sizeof (chars));
+        use_dictionary_for(pre, pre_len);
+        word_scores_len = 0;
 
         /* Numbers follow numbers */
-        if (g_ascii_isdigit(pre[pre_len - 1])) {
+        if (pre_len && g_unichar_isdigit(pre[pre_len - 1])) {
                 for (i = 0; i <= 9; i++)
-                        chars['0' + i] = 1;
-                goto apply_table;
+                        add_word_score('0' + i, 1);
+                goto apply_scores;
         }
 
-        /* Search the databases for matches (FIXME sort/index) */
-        for (i = 0; i < wordfreqs_len; i++)
-                if ((!pre_len ||
-                     !g_ascii_strncasecmp(pre, wordfreqs[i].string, pre_len)) &&
-                    (!post_len ||
-                     !g_ascii_strncasecmp(post, wordfreqs[i].string + pre_len +
-                                          1, post_len))) {
-                        int ch = wordfreqs[i].string[pre_len],
-                            ch_lower = ch, ch_upper = 0;
+        /* Every child of the prefix node is a possible next character, the
+           words that also match the rest of the word are found under it */
+        node = word_node_find(pre, pre_len);
+        for (i = 0; node >= 0 && i < (int)word_nodes[node].children_len;
+             i++) {
+                gunichar ch;
+                int child, count;
 
-                        if (ch < 32 || ch >= 127)
+                child = word_nodes[node].children + i;
+                ch = word_nodes[child].ch;
+                if (!g_unichar_isgraph(ch))
+                        continue;
+                if (post_len) {
+                        child = word_node_descend(child, post, post_len);
+                        if (child < 0)
                                 continue;
+                }
+                count = word_nodes[child].count;
+                if (count)
+                        add_case_scores(pre, pre_len, ch, count);
+        }
 
-                        /* Suggest proper case */
-                        if (g_ascii_isalpha(ch)) {
-                                ch_lower = g_ascii_tolower(ch);
-                                ch_upper = g_ascii_toupper(ch);
-                                if (pre_len > 1) {
-                                        if (g_ascii_islower(pre[pre_len - 1]))
-                                                ch_upper = 0;
-                                        else
-                                        if (g_ascii_isupper(pre[pre_len - 1]) &&
-                                            g_ascii_isupper(pre[pre_len - 2]))
-                                                ch_lower = 0;
-                                }
-                        }
+        /* Learned words are scored on top of the dictionary */
+        for (i = 0; i < learned_len; i++) {
+                const LearnedWord *word = learned[i];
 
-                        chars[ch_lower] += wordfreqs[i].count;
-                        chars[ch_upper] += wordfreqs[i].count;
-                }
+                if (word->len > pre_len + post_len &&
+                    learned_match(word->string, pre, pre_len) &&
+                    learned_match(word->string + pre_len + 1, post, post_len))
+                        add_case_scores(pre, pre_len, word->string[pre_len],
+                                        learned_score(word));
+        }
+
+        /* Different dictionary characters can have the same upper-case
+           character so merge any duplicates */
+        qsort(word_scores, word_scores_len, sizeof (*word_scores),
+              (GCompareFunc)word_score_compare);
+        for (i = 1, j = 0; i < word_scores_len; i++)
+                if (word_scores[i].ch == word_scores[j].ch)
+                        word_scores[j].score += word_scores[i].score;
+                else
+                        word_scores[++j] = word_scores[i];
+        if (word_scores_len)
+                word_scores_len = j + 1;
+
+apply_scores:
+        if (!word_scores_len)
+                return;
+
+        /* Scores are sums over large subtrees with a big dictionary, scale
+           them down to fit instead of letting the common ones saturate */
+        for (i = 1, max = word_scores[0].score; i < word_scores_len; i++)
+                if (word_scores[i].score > max)
+                        max = word_scores[i].score;
+        if (max > G_MAXSHORT)
+                for (i = 0; i < word_scores_len; i++)
+                        word_scores[i].score = (gint64)word_scores[i].score *
+                                               G_MAXSHORT / max;
 
-apply_table:
-        /* Apply characters table */
         sampleiter_reset();
         while ((sample = sampleiter_next()))
-                if (sample->ch >= 32 && sample->ch < 127)
-                        sample->ratings[ENGINE_WORDFREQ] = chars[sample->ch];
+                sample->ratings[ENGINE_WORDFREQ] = word_score(sample->ch);
+}
+
+/*
+        Character n-gram engine
+*/
+
+void engine_ngram(void)
+/* Rate candidates by how likely they are to follow the previous one or two
+   characters of the word. The first character of a word follows the word
+   boundary, which the table counts as zero. */
+{
+        Sample *sample;
+        const gunichar *pre;
+        guint32 x, y;
+        int pre_len;
+
+        if (!wordfreq_enable || !ngrams_size)
+                return;
+        pre = cell_widget_word();
+        pre_len = ucs4_len(pre);
+        y = pre_len > 0 ? g_unichar_tolower(pre[pre_len - 1]) : 0;
+        x = pre_len > 1 ? g_unichar_tolower(pre[pre_len - 2]) : 0;
+        sampleiter_reset();
+        while ((sample = sampleiter_next())) {
+                guint32 z;
+                int value;
+
+                if (!sample->ch)
+                        continue;
+                z = g_unichar_tolower(sample->ch);
+                value = ngram_lookup(x, y, z);
+                if (!value) {
+                        value = ngram_lookup(NGRAM_NONE, y, z) - NGRAM_BACKOFF;
+                        if (value < 0)
+                                value = 0;
+                }
+                sample->ratings[ENGINE_NGRAM] = value;
+        }
 }
 
 #endif /* DISABLE_WORDFREQ */